@@ -0,0 +1,310 @@
+/*
+ * bptree_bench: YCSB style workloads against LRUBPTree.
+ * Every run bulk loads a fresh tree, reopens it with a cache holding a fraction of its nodes,
+ * runs a mix of operations from one or more threads and reports throughput and latency percentiles
+ * per operation, on the console and as one JSON object per line in the results file.
+ *
+ *   bptree_bench [--records N] [--ops N] [--threads N] [--workloads A,B,C,D,E,F,L,W] [--dist zipfian|uniform]
+ *                [--cache 0.01,0.1,1] [--short-scan N] [--long-scan N] [--path FILE] [--out FILE] [--cold]
+ *
+ * Workloads, as fractions of the operations:
+ *   A  read 0.5, update 0.5             B  read 0.95, update 0.05         C  read 1
+ *   D  read 0.95, insert 0.05, reads favour the latest records           E  short scan 0.95, insert 0.05
+ *   F  read 0.5, read-modify-write 0.5  L  long scan 1                    W  insert 0.5, remove 0.5
+ * --cold drops the tree file from the page cache before each run, so misses of the tree's own cache go to the disk.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../src/LRUBPtree.h"
+
+namespace bench {
+    typedef uint64_t Key;
+    typedef uint64_t Value;
+    typedef bptree::LRUBPTree<Key, Value> Tree;
+    typedef std::chrono::steady_clock Clock;
+
+    enum op_t {
+        READ, UPDATE, INSERT, REMOVE, SHORT_SCAN, LONG_SCAN, RMW, OP_COUNT
+    };
+    const char* const OP_NAMES[OP_COUNT] = {"read", "update", "insert", "remove", "short_scan", "long_scan", "rmw"};
+
+    struct Workload {
+        char name;
+        double mix[OP_COUNT];
+        bool latest;    // reads favour the records inserted last
+    };
+
+    const Workload WORKLOADS[] = {
+            {'A', {0.5, 0.5, 0, 0, 0, 0, 0},     false},
+            {'B', {0.95, 0.05, 0, 0, 0, 0, 0},   false},
+            {'C', {1, 0, 0, 0, 0, 0, 0},         false},
+            {'D', {0.95, 0, 0.05, 0, 0, 0, 0},   true},
+            {'E', {0, 0, 0.05, 0, 0.95, 0, 0},   false},
+            {'F', {0.5, 0, 0, 0, 0, 0, 0.5},     false},
+            {'L', {0, 0, 0, 0, 0, 1, 0},         false},
+            {'W', {0, 0, 0.5, 0.5, 0, 0, 0},     false},
+    };
+
+    struct Config {
+        size_t records = 1000000;
+        size_t ops = 1000000;
+        size_t threads = 1;
+        std::string workloads = "A,B,C,D,E,F,L,W";
+        bool zipfian = true;
+        std::vector<double> cache = {0.01, 0.1, 1};
+        size_t short_scan = 100;
+        size_t long_scan = 10000;
+        std::string path = "bptree_bench.db";
+        std::string out = "bptree_bench.jsonl";
+        bool cold = false;
+    };
+
+    // a bijection of 64-bit integers, so that record i has a unique key spread over the key space
+    inline Key key_of(uint64_t i) {
+        i ^= i >> 30;
+        i *= 0xbf58476d1ce4e5b9ull;
+        i ^= i >> 27;
+        i *= 0x94d049bb133111ebull;
+        return i ^ (i >> 31);
+    }
+
+    /*
+     * Zipfian: ranks in [0, n) with the popularity of rank r falling as 1/(r+1)^theta,
+     * Gray et al.'s generator as YCSB uses it, theta 0.99 by default
+     */
+    class Zipfian {
+        uint64_t n;
+        double theta, alpha, zetan, eta;
+
+        static double zeta(uint64_t n, double theta) {
+            double sum = 0;
+            for (uint64_t i = 1; i <= n; ++i)sum += 1/std::pow((double) i, theta);
+            return sum;
+        }
+
+    public:
+        explicit Zipfian(uint64_t n, double theta = 0.99) : n(n), theta(theta) {
+            zetan = zeta(n, theta);
+            alpha = 1/(1-theta);
+            eta = (1-std::pow(2.0/(double) n, 1-theta))/(1-zeta(2, theta)/zetan);
+        }
+
+        uint64_t next(std::mt19937_64& rng) const {
+            double u = std::uniform_real_distribution<double>(0, 1)(rng);
+            double uz = u*zetan;
+            if (uz < 1)return 0;
+            if (uz < 1+std::pow(0.5, theta))return 1;
+            return std::min(n-1, (uint64_t) ((double) n*std::pow(eta*u-eta+1, alpha)));
+        }
+    };
+
+    struct Result {
+        std::vector<uint64_t> latency[OP_COUNT];   // ns
+    };
+
+    double percentile(const std::vector<uint64_t>& sorted, double p) {
+        if (sorted.empty())return 0;
+        size_t i = std::min(sorted.size()-1, (size_t) std::ceil(p*(double) sorted.size())-(p > 0));
+        return (double) sorted[i]/1000;
+    }
+
+    size_t file_blocks(const std::string& path) {
+        struct stat st{};
+        if (::stat(path.c_str(), &st))throw std::runtime_error("bench: can't stat "+path);
+        return (size_t) st.st_size/bptree::Node<Key, Value>::BLOCK_SIZE;
+    }
+
+    void drop_page_cache(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)return;
+        ::fdatasync(fd);
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+    }
+
+    void load(const Config& config) {
+        ::remove(config.path.c_str());
+        std::vector<std::pair<Key, Value>> pairs(config.records);
+        for (size_t i = 0; i < config.records; ++i)pairs[i] = {key_of(i), i};
+        std::sort(pairs.begin(), pairs.end());
+        Tree tree(config.path, 1024, true);
+        tree.bulk_load(pairs.begin(), pairs.end());
+    }
+
+    /*
+     * run: ops operations of the workload against the tree, split over the threads.
+     * Records [0, inserted) exist unless removed, inserts take the next number.
+     */
+    double run(Tree& tree, const Config& config, const Workload& w, Result& result) {
+        std::atomic<uint64_t> inserted(config.records);
+        Zipfian zipf(config.records);
+        std::vector<Result> per_thread(config.threads);
+        std::vector<std::thread> threads;
+        auto start = Clock::now();
+        for (size_t t = 0; t < config.threads; ++t) {
+            threads.emplace_back([&, t] {
+                std::mt19937_64 rng(t+1);
+                std::discrete_distribution<int> pick(w.mix, w.mix+OP_COUNT);
+                Result& mine = per_thread[t];
+                size_t ops = config.ops/config.threads+(t < config.ops%config.threads);
+                for (size_t i = 0; i < ops; ++i) {
+                    uint64_t count = inserted.load(std::memory_order_relaxed);
+                    uint64_t record;
+                    if (w.latest) record = count-1-std::min(count-1, zipf.next(rng));
+                    // scrambled, so that the popular records are spread over the leaves
+                    else if (config.zipfian) record = key_of(zipf.next(rng))%count;
+                    else record = std::uniform_int_distribution<uint64_t>(0, count-1)(rng);
+                    Key key = key_of(record);
+                    auto op = (op_t) pick(rng);
+                    auto begin = Clock::now();
+                    switch (op) {
+                        case READ:
+                            tree.search(key);
+                            break;
+                        case UPDATE: {
+                            std::pair<Key, Value> p(key, i);
+                            tree.insert_batch(&p, &p+1, true);
+                            break;
+                        }
+                        case INSERT:
+                            tree.insert(key_of(inserted.fetch_add(1)), i);
+                            break;
+                        case REMOVE:
+                            tree.remove(key);
+                            break;
+                        case SHORT_SCAN:
+                        case LONG_SCAN: {
+                            size_t n = op == SHORT_SCAN ? config.short_scan : config.long_scan;
+                            Value sum = 0;
+                            for (auto c = tree.cursor(key); c.valid() && n; c.next(), --n)sum += c.value();
+                            asm volatile("" : : "r"(sum));
+                            break;
+                        }
+                        case RMW: {
+                            std::pair<Key, Value> p(key, tree.search(key).first+1);
+                            tree.insert_batch(&p, &p+1, true);
+                            break;
+                        }
+                        default:
+                            break;
+                    }
+                    mine.latency[op].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now()-begin).count());
+                }
+            });
+        }
+        for (auto& t : threads)t.join();
+        double seconds = std::chrono::duration<double>(Clock::now()-start).count();
+        for (auto& r : per_thread)
+            for (int op = 0; op < OP_COUNT; ++op)
+                result.latency[op].insert(result.latency[op].end(), r.latency[op].begin(), r.latency[op].end());
+        return seconds;
+    }
+
+    void report(FILE* out, const Config& config, const Workload& w, double ratio, size_t cache_blocks,
+                double seconds, Result& result) {
+        const char* dist = w.latest ? "latest" : config.zipfian ? "zipfian" : "uniform";
+        std::vector<uint64_t> all;
+        for (int op = 0; op <= OP_COUNT; ++op) {
+            std::vector<uint64_t>& lat = op < OP_COUNT ? result.latency[op] : all;
+            if (op < OP_COUNT)all.insert(all.end(), lat.begin(), lat.end());
+            if (lat.empty())continue;
+            std::sort(lat.begin(), lat.end());
+            const char* name = op < OP_COUNT ? OP_NAMES[op] : "all";
+            double throughput = (double) lat.size()/seconds;
+            double p50 = percentile(lat, 0.5), p99 = percentile(lat, 0.99), p999 = percentile(lat, 0.999);
+            printf("%c  %-8s cache %-6g %-10s %9zu ops %12.0f ops/s   p50 %9.2fus  p99 %9.2fus  p999 %9.2fus\n",
+                   w.name, dist, ratio, name,
+                   lat.size(), throughput, p50, p99, p999);
+            if (out)
+                fprintf(out, "{\"workload\":\"%c\",\"dist\":\"%s\",\"records\":%zu,\"threads\":%zu,\"cache_ratio\":%g,"
+                             "\"cache_blocks\":%zu,\"cold\":%s,\"op\":\"%s\",\"count\":%zu,\"seconds\":%.6f,"
+                             "\"ops_per_sec\":%.1f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f}\n",
+                        w.name, dist, config.records,
+                        config.threads, ratio, cache_blocks, config.cold ? "true" : "false", name, lat.size(),
+                        seconds, throughput, p50, p99, p999);
+        }
+        if (out)fflush(out);
+    }
+
+    std::vector<double> parse_list(const std::string& s) {
+        std::vector<double> values;
+        for (size_t i = 0; i < s.size();) {
+            size_t j = s.find(',', i);
+            if (j == std::string::npos)j = s.size();
+            values.push_back(std::stod(s.substr(i, j-i)));
+            i = j+1;
+        }
+        return values;
+    }
+
+    Config parse(int argc, char** argv) {
+        Config config;
+        for (int i = 1; i < argc; ++i) {
+            std::string flag = argv[i];
+            if (flag == "--cold") {
+                config.cold = true;
+                continue;
+            }
+            if (i+1 == argc)throw std::invalid_argument("bench: "+flag+" needs a value");
+            std::string value = argv[++i];
+            if (flag == "--records")config.records = std::stoull(value);
+            else if (flag == "--ops")config.ops = std::stoull(value);
+            else if (flag == "--threads")config.threads = std::max<size_t>(1, std::stoull(value));
+            else if (flag == "--workloads")config.workloads = value;
+            else if (flag == "--dist")config.zipfian = value != "uniform";
+            else if (flag == "--cache")config.cache = parse_list(value);
+            else if (flag == "--short-scan")config.short_scan = std::stoull(value);
+            else if (flag == "--long-scan")config.long_scan = std::stoull(value);
+            else if (flag == "--path")config.path = value;
+            else if (flag == "--out")config.out = value;
+            else throw std::invalid_argument("bench: unknown flag "+flag);
+        }
+        if (config.records < 2)throw std::invalid_argument("bench: --records must be at least 2");
+        return config;
+    }
+}
+
+int main(int argc, char** argv) {
+    using namespace bench;
+    Config config;
+    try {
+        config = parse(argc, argv);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 2;
+    }
+    FILE* out = config.out.empty() ? nullptr : fopen(config.out.c_str(), "a");
+    for (const Workload& w : WORKLOADS) {
+        if (config.workloads.find(w.name) == std::string::npos)continue;
+        for (double ratio : config.cache) {
+            load(config);
+            // enough blocks for the nodes pinned by every thread at once
+            size_t cache_blocks = std::max<size_t>(256*config.threads, (size_t) (ratio*(double) file_blocks(config.path)));
+            if (config.cold)drop_page_cache(config.path);
+            Result result;
+            double seconds;
+            {
+                Tree tree(config.path, cache_blocks);
+                seconds = run(tree, config, w, result);
+            }
+            report(out, config, w, ratio, cache_blocks, seconds, result);
+        }
+    }
+    if (out)fclose(out);
+    ::remove(config.path.c_str());
+    return 0;
+}
@@ -4,46 +4,140 @@
 
 #include <fstream>
 #include <cstring>
+#include <mutex>
+#include <memory>
 #include "bptree.h"
 #include "cache.h"
-#include "../include/file_alternative.h"
+#include "wal.h"
+#include "io.h"
+#include "codec.h"
 using std::ios;
 namespace bptree {
+    struct LRUBPTreeOptions {
+        size_t shards = 16;
+        cache::policy_t policy = cache::LRU;
+        // keep internal nodes, touched by every search, resident ahead of leaves
+        bool prioritize_internal = false;
+        // redo log in <path>.wal, replayed when the tree is opened after a crash
+        bool wal = false;
+        wal::sync_t wal_sync = wal::SYNC_GROUP;
+        size_t wal_group_ops = 64;
+        size_t wal_group_micros = 2000;
+        // checkpoint once the log grows past this size
+        size_t checkpoint_bytes = 64 << 20;
+        // io_uring falls back to the thread pool where the kernel refuses it
+        io::engine_t io_engine = io::IO_URING;
+        size_t io_threads = 4;
+        // evicted dirty nodes are written back this many at a time
+        size_t io_batch_pages = 32;
+        // a background thread writes cold dirty nodes back ahead of eviction, keeping the clean_reserve
+        // coldest nodes of each shard clean and at most dirty_high_water of each shard dirty.
+        // Off by default: nodes that are dirtied again after the write are written twice
+        bool background_flush = false;
+        size_t clean_reserve = 8;
+        double dirty_high_water = 0.9;
+        size_t flush_interval_ms = 100;
+        // node format of a new file, an existing file keeps the one recorded in its header
+        codec_t codec = CODEC_RAW;
+        // internal nodes whose separators searches look up in memory, see BPTree::set_top_index
+        size_t top_index_nodes = 0;
+        // child slots of cached internal nodes remember where the child is cached, skipping the cache's table
+        bool swizzle = true;
+    };
+
     /*
-     *  Cache size must be at least 4 times than the DEPTH in order to ensure work correctly.
+     *  Nodes are pinned in the cache while an operation uses them, so the cache only needs room
+     *  for the nodes in use at once: about 3 per level for each concurrent operation, per shard.
      */
 
 
-    template<typename KeyType, typename ValueType, typename WeakCmp=std::less<KeyType>>
-    class LRUBPTree : public BPTree<KeyType, ValueType,WeakCmp> {
+    template<typename KeyType, typename ValueType, typename WeakCmp=std::less<KeyType>,
+            size_t Degree = node_degree<KeyType, ValueType>()>
+    class LRUBPTree : public BPTree<KeyType, ValueType, WeakCmp, Degree> {
     private:
         static const size_t NO_FREE = SIZE_MAX;
-        typedef Node<KeyType,ValueType>* NodePtr;
-        typedef const Node<KeyType,ValueType>* ConstNodePtr;
+        // recorded in the header while a compaction holds the free blocks, the freelist is rebuilt on open
+        static const size_t LOST_FREE = SIZE_MAX-1;
+        typedef Node<KeyType, ValueType, Degree>* NodePtr;
+        typedef const Node<KeyType, ValueType, Degree>* ConstNodePtr;
+
 
+        cache::ShardedCache<DiskLoc_T ,Node<KeyType, ValueType, Degree>> cache;
 
-        cache::LRUCache<DiskLoc_T ,Node<KeyType,ValueType>> cache;
+        void load(DiskLoc_T offset, NodePtr tobe_filled);
 
-        static void load(ds::File& ifs, DiskLoc_T offset, NodePtr tobe_filled);
+        void flush(ConstNodePtr node);
 
-        static void flush(ds::File& ofs, ConstNodePtr node);
+        // bytes written for an image of len bytes: whole pages, at most the block
+        static size_t image_span(size_t len);
 
-        NodePtr initNode(typename Node<KeyType, ValueType>::type_t t) override;
+        NodePtr initNode(typename Node<KeyType, ValueType, Degree>::type_t t) override;
 
         void saveNode(NodePtr node) override;
 
         NodePtr loadNode(DiskLoc_T offset) override;
 
+        NodePtr loadChild(NodePtr parent, size_t i) override;
+
         void deleteNode(NodePtr node) override;
 
-        bool createTree(const std::string& path);
+        void releaseNode(NodePtr node) override;
+
+        void commitOp() override;
+
+        void syncOp() override {
+            if (log)log->settle();
+        }
+
+        void prefetchNode(DiskLoc_T offset) override;
+
+        void prefetchNodes(const DiskLoc_T* offsets, size_t n) override;
+
+        // the header takes the first block
+        size_t blockCount() override { return file_size/Node<KeyType, ValueType, Degree>::BLOCK_SIZE-1; }
+
+        DiskLoc_T blockOffset(size_t i) override { return (i+1)*Node<KeyType, ValueType, Degree>::BLOCK_SIZE; }
+
+        void setBlocks(size_t n) override;
+
+        void compacted() override;
+
+        // thread every block the tree doesn't reach into the freelist
+        void rebuild_freelist();
+
+        bool createTree(const std::string& path, codec_t c);
+
+        void header(char* buf) const;
+
+        void recover();
 
-//        std::fstream file;
-        ds::File file;
+        void checkpoint_unlocked();
+
+        static const size_t HEADER_SIZE = sizeof(size_t)+2*sizeof(DiskLoc_T)+sizeof(codec_t);
+
+        std::string file_path;
+        codec_t codec;
+        std::unique_ptr<io::File> file;
         size_t file_size;
         DiskLoc_T freelist_head;
+        bool compacting;
+
+        std::unique_ptr<wal::WriteAheadLog> log;
+        std::vector<DiskLoc_T> op_dirty;    // saved since the last commitOp
+        char logged_header[HEADER_SIZE];
+        size_t checkpoint_bytes;
+        bool swizzling;
     public:
-        LRUBPTree(const std::string& path, size_t block_size, bool create= false);
+        LRUBPTree(const std::string& path, size_t block_size, bool create= false,
+                  const LRUBPTreeOptions& options = LRUBPTreeOptions());
+
+        /*
+         * sync: make every completed insert/remove durable in the log
+         * checkpoint: write back dirty nodes and the header, then drop the log
+         */
+        void sync();
+
+        void checkpoint();
 
 //        LRUBPTree()=default;
 //
@@ -58,29 +152,39 @@ namespace bptree {
 
 
 
-    template<typename KeyType,typename ValueType, typename WeakCmp>
-    void LRUBPTree<KeyType, ValueType,WeakCmp>::flush(ds::File& ofs, ConstNodePtr node) {
-        char buffer[Node<KeyType,ValueType>::BLOCK_SIZE];
-        writeBuffer(node, buffer);
-        ofs.seekp(node->offset);
-        if (ofs.fail())throw std::runtime_error("CacheBPTree: Can't write");
-        ofs.write(buffer, Node<KeyType,ValueType>::BLOCK_SIZE);
-        if (ofs.fail())throw std::runtime_error("CacheBPTree: Write failure");
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    size_t LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::image_span(size_t len) {
+        size_t span = (len+DEFAULT_PAGE_SIZE-1)/DEFAULT_PAGE_SIZE*DEFAULT_PAGE_SIZE;
+        return span < Node<KeyType, ValueType, Degree>::BLOCK_SIZE ? span : Node<KeyType, ValueType, Degree>::BLOCK_SIZE;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::flush(ConstNodePtr node) {
+        char buffer[Node<KeyType, ValueType, Degree>::BLOCK_SIZE];
+        bzero(buffer, sizeof(buffer));
+        // pages behind a compressed image are left as they are
+        size_t len = image_span(encodeNode(codec, node, buffer));
+        file->write_async(node->offset, buffer, len);
+        this->counters.add(analysis::NODE_FLUSH);
+        this->counters.add(analysis::BYTES_WRITTEN, len);
     }
 
-    template<typename KeyType,typename ValueType,typename WeakCmp>
-    void LRUBPTree<KeyType,ValueType,WeakCmp>::load(ds::File& ifs, bptree::DiskLoc_T offset, NodePtr tobe_filled) {
-        char buffer[Node<KeyType,ValueType>::BLOCK_SIZE];
-        ifs.seekg(offset);
-        if (ifs.fail())throw std::runtime_error("CacheBPTree: Can't read");
-        ifs.read(buffer, Node<KeyType,ValueType>::BLOCK_SIZE);
-        readBuffer(tobe_filled, buffer);
-        if (ifs.fail())throw std::runtime_error("CacheBPTree: Read failure");
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::load(bptree::DiskLoc_T offset, NodePtr tobe_filled) {
+        char buffer[Node<KeyType, ValueType, Degree>::BLOCK_SIZE];
+        size_t first = codec == CODEC_RAW ? Node<KeyType, ValueType, Degree>::BLOCK_SIZE : image_span(1);
+        file->read(offset, buffer, first);
+        size_t len = image_span(imageLength<KeyType, ValueType, Degree>(codec, buffer));
+        // the whole image again rather than its tail, a queued write is only found at the block offset
+        if (len > first)file->read(offset, buffer, len);
+        decodeNode(codec, tobe_filled, offset, buffer);
+        this->counters.add(analysis::NODE_LOAD);
+        this->counters.add(analysis::BYTES_READ, len > first ? first+len : first);
     }
 
-    template<typename KeyType,typename ValueType,typename WeakCmp>
-    Node<KeyType,ValueType>* LRUBPTree<KeyType,ValueType,WeakCmp>::initNode(typename bptree::Node<KeyType,ValueType>::type_t t) {
-        typedef Node<KeyType,ValueType> Node;
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    Node<KeyType, ValueType, Degree>* LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::initNode(typename bptree::Node<KeyType, ValueType, Degree>::type_t t) {
+        typedef Node<KeyType, ValueType, Degree> Node;
         if (freelist_head == NO_FREE) {
             // extend file
             char block[Node::BLOCK_SIZE];
@@ -89,56 +193,224 @@ namespace bptree {
             n.type = Node::FREE;
             n.offset = file_size;
             n.next = NO_FREE;
-            writeBuffer(&n, block);
-            file.seekp(file_size);
-            file.write(block, Node::BLOCK_SIZE);
-            if (file.fail())throw std::runtime_error("CacheBPTree: initNode()");
+            file->write_async(file_size, block, image_span(encodeNode(codec, &n, block)));
             freelist_head = file_size;
             file_size += Node::BLOCK_SIZE;
         }
         NodePtr ptr = cache.get(freelist_head);
         freelist_head = ptr->next;
         ptr->type = t;
+        ptr->size = 0;
         return ptr;
     }
 
-    template<typename KeyType,typename ValueType,typename WeakCmp>
-    void LRUBPTree<KeyType,ValueType,WeakCmp>::saveNode(NodePtr node) {
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::saveNode(NodePtr node) {
         cache.dirty_bit_set(node->offset);
+        if (log)op_dirty.push_back(node->offset);
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    Node<KeyType, ValueType, Degree>* LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::loadNode(bptree::DiskLoc_T offset) {
+        return cache.get(unswizzle(offset), swizzled_slot(offset));
     }
 
-    template<typename KeyType,typename ValueType,typename WeakCmp>
-    Node<KeyType,ValueType>* LRUBPTree<KeyType,ValueType,WeakCmp>::loadNode(bptree::DiskLoc_T offset) {
-        return cache.get(offset);
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    Node<KeyType, ValueType, Degree>* LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::loadChild(NodePtr parent, size_t i) {
+        DiskLoc_T ref = this->child(parent, i);
+        NodePtr node = loadNode(ref);
+        if (!swizzling)return node;
+        // the parent is pinned, readers sharing it may race to store the same child, any of their values is right
+        DiskLoc_T now = swizzle(node->offset, cache.slot_of(node->offset, node));
+        if (now != ref)__atomic_store_n(&parent->sub_nodes[i], now, __ATOMIC_RELAXED);
+        return node;
     }
 
 
-    template<typename KeyType,typename ValueType,typename WeakCmp>
-    void LRUBPTree<KeyType,ValueType,WeakCmp>::deleteNode(NodePtr node) {
-        node->type = Node<KeyType,ValueType>::FREE;
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::releaseNode(NodePtr node) {
+        cache.unpin(node->offset, node);
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::deleteNode(NodePtr node) {
+        // the freed block stays cached and pinned until the operation commits
+        node->type = Node<KeyType, ValueType, Degree>::FREE;
         node->next = freelist_head;
-        auto tmp = node->next;
+        freelist_head = node->offset;
         saveNode(node);
-        cache.remove(node->offset);
-        freelist_head = tmp;
     }
 
-    template <typename KeyType,typename ValueType,typename WeakCmp>
-    bool LRUBPTree<KeyType,ValueType,WeakCmp>::createTree(const std::string& path) {
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::prefetchNode(DiskLoc_T offset) {
+        // the next leaf of a scan, read it into the page cache while the cursor works on this one
+        if (!cache.contains(offset))file->prefetch(offset, Node<KeyType, ValueType, Degree>::BLOCK_SIZE);
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::prefetchNodes(const DiskLoc_T* offsets, size_t n) {
+        const size_t BLOCK_SIZE = Node<KeyType, ValueType, Degree>::BLOCK_SIZE;
+        std::vector<DiskLoc_T> missing;
+        for (size_t i = 0; i < n; ++i)
+            if (!cache.contains(offsets[i]))missing.push_back(offsets[i]);
+        // leaves next to each other in the file, as compact() lays them out, are read as one
+        std::sort(missing.begin(), missing.end());
+        for (size_t i = 0, j; i < missing.size(); i = j) {
+            for (j = i+1; j < missing.size() && missing[j] == missing[j-1]+BLOCK_SIZE;)++j;
+            file->prefetch(missing[i], (j-i)*BLOCK_SIZE);
+        }
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::setBlocks(size_t n) {
+        freelist_head = NO_FREE;
+        compacting = true;
+        DiskLoc_T end = blockOffset(n);
+        if (end >= file_size)return;
+        // the dropped blocks are free, writing them back would only grow the file again
+        for (DiskLoc_T offset = end; offset < file_size; offset += Node<KeyType, ValueType, Degree>::BLOCK_SIZE)
+            cache.discard(offset);
+        file_size = end;
+        // the header and the log must not refer past the end before it is cut
+        checkpoint_unlocked();
+        file->truncate(file_size);
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::compacted() {
+        compacting = false;
+        // log the complete freelist now rather than with the next writer
+        commitOp();
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::rebuild_freelist() {
+        typedef Node<KeyType, ValueType, Degree> NodeT;
+        std::vector<bool> live(blockCount(), false);
+        auto mark = [this, &live](DiskLoc_T offset) { live[offset/NodeT::BLOCK_SIZE-1] = true; };
+        // the leaves are known from their parents, only the internal levels are read
+        int height = 0;
+        for (DiskLoc_T offset = this->root; offset != NodeT::NONE; ++height) {
+            NodePtr node = loadNode(offset);
+            offset = node->type == NodeT::INTERNAL ? unswizzle(this->child(node, 0)) : NodeT::NONE;
+            releaseNode(node);
+        }
+        std::vector<DiskLoc_T> level, below;
+        if (height)level.push_back(this->root);
+        for (int depth = 0; depth < height; ++depth) {
+            below.clear();
+            for (DiskLoc_T offset : level) {
+                mark(offset);
+                if (depth+1 == height)continue;
+                NodePtr node = loadNode(offset);
+                for (size_t i = 0; i <= node->size; ++i)below.push_back(unswizzle(this->child(node, i)));
+                releaseNode(node);
+            }
+            level.swap(below);
+        }
+        // from the back, so that the freelist hands out the front of the file first
+        freelist_head = NO_FREE;
+        for (size_t i = live.size(); i--;) {
+            if (live[i])continue;
+            NodePtr node = loadNode(blockOffset(i));
+            deleteNode(node);
+            releaseNode(node);
+        }
+        op_dirty.clear();
+        checkpoint_unlocked();
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::header(char* buf) const {
+#define write_attribute(ATTR) memcpy(buf,(void*)&ATTR,sizeof(ATTR));buf+=sizeof(ATTR)
+        DiskLoc_T free = compacting ? LOST_FREE : freelist_head;
+        write_attribute(file_size);
+        write_attribute(free);
+        write_attribute(this->root);
+        write_attribute(codec);
+#undef write_attribute
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::commitOp() {
+        if (!log)return;
+        char head[HEADER_SIZE];
+        header(head);
+        if (op_dirty.empty() && !memcmp(head, logged_header, HEADER_SIZE))return;
+        std::sort(op_dirty.begin(), op_dirty.end());
+        op_dirty.erase(std::unique(op_dirty.begin(), op_dirty.end()), op_dirty.end());
+        char buffer[Node<KeyType, ValueType, Degree>::BLOCK_SIZE];
+        for (DiskLoc_T offset : op_dirty) {
+            // still pinned by the operation, so this is a cache hit
+            NodePtr node = cache.get(offset);
+            bzero(buffer, sizeof(buffer));
+            encodeNode(codec, node, buffer);
+            cache.unpin(offset, node);
+            log->add_page(offset, buffer);
+        }
+        log->commit(head, HEADER_SIZE);
+        memcpy(logged_header, head, HEADER_SIZE);
+        op_dirty.clear();
+        if (log->size() >= checkpoint_bytes)checkpoint_unlocked();
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::checkpoint_unlocked() {
+        // the io writer syncs the log before the pages, so the data file never runs ahead of it
+        cache.flush_all();
+        // nodes reach the file before the header that points at them
+        file->drain();
+        char head[HEADER_SIZE];
+        header(head);
+        file->write(0, head, HEADER_SIZE);
+        file->sync();
+        if (log)log->truncate();
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::checkpoint() {
+        std::unique_lock<std::shared_mutex> guard(this->latch);
+        checkpoint_unlocked();
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::sync() {
+        if (log)log->sync();
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::recover() {
+        // redo every committed operation since the last checkpoint, the last header wins
+        size_t replayed = log->replay(
+                [this](uint64_t offset, const char* image) {
+                    file->write(offset, image, Node<KeyType, ValueType, Degree>::BLOCK_SIZE);
+                },
+                [this](const char* head, uint32_t len) {
+                    file->write(0, head, len);
+                });
+        if (replayed)file->sync();
+        // a torn or corrupted tail goes too, records appended behind it would never be replayed
+        if (log->size())log->truncate();
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    bool LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::createTree(const std::string& path, codec_t c) {
         std::fstream f(path, ios::in | ios::out | ios::binary);
         if (f.is_open() || f.bad()) { return false; }
         f.close();
         f = std::fstream(path, ios::out | ios::binary);
 #define write_attribute(ATTR) memcpy(ptr,(void*)&ATTR,sizeof(ATTR));ptr+=sizeof(ATTR)
-        char buf[sizeof(LRUBPTree<KeyType,ValueType>::file_size)+sizeof(LRUBPTree<KeyType,ValueType>::freelist_head)+sizeof(LRUBPTree<KeyType,ValueType>::root)];
+        // the header takes a whole block so that every node starts block aligned
+        char buf[Node<KeyType, ValueType, Degree>::BLOCK_SIZE];
+        bzero(buf, sizeof(buf));
         char* ptr = buf;
         size_t size = sizeof(buf);
-        DiskLoc_T free = LRUBPTree<KeyType,ValueType>::NO_FREE;
-        DiskLoc_T t = Node<KeyType,ValueType>::NONE;
+        DiskLoc_T free = LRUBPTree::NO_FREE;
+        DiskLoc_T t = Node<KeyType, ValueType, Degree>::NONE;
         write_attribute(size);
         write_attribute(free);
         write_attribute(t); // root
-        write_attribute(t); // sequential_head
+        write_attribute(c);
         f.write(buf, sizeof(buf));
         f.close();
         return true;
@@ -147,38 +419,61 @@ namespace bptree {
 
 
 
-    template<typename KeyType,typename ValueType,typename WeakCmp>
-    LRUBPTree<KeyType,ValueType,WeakCmp>::LRUBPTree(const std::string& path, size_t block_size, bool create) :
-            BPTree<KeyType,ValueType,WeakCmp>(),
-            cache(block_size, [this](DiskLoc_T o, NodePtr r) { load(file, o, r); }, [this](DiskLoc_T o,ConstNodePtr r) { flush(file, r); }) {
-        if(create)
-            createTree(path);
-        file.open(path.c_str());
-        char buf[sizeof(file_size)+sizeof(freelist_head)+sizeof(this->root)];
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::LRUBPTree(const std::string& path, size_t block_size, bool create,
+                                                   const LRUBPTreeOptions& options) :
+            BPTree<KeyType, ValueType, WeakCmp, Degree>(),
+            cache(block_size, options.shards,
+                  [this](DiskLoc_T o, NodePtr r) { load(o, r); },
+                  [this](DiskLoc_T, ConstNodePtr r) { flush(r); },
+                  options.policy,
+                  options.prioritize_internal ? [](ConstNodePtr r) { return r->type == Node<KeyType, ValueType, Degree>::INTERNAL; }
+                                              : cache::func_hot_t<Node<KeyType, ValueType, Degree>>()),
+            file_path(path), compacting(false), checkpoint_bytes(options.checkpoint_bytes), swizzling(options.swizzle) {
+        bool created = create && createTree(path, options.codec);
+        file.reset(new io::File(path, options.io_engine, options.io_threads, options.io_batch_pages));
+        if (options.wal) {
+            log.reset(new wal::WriteAheadLog(path+".wal", Node<KeyType, ValueType, Degree>::BLOCK_SIZE, options.wal_sync,
+                                             options.wal_group_ops, options.wal_group_micros));
+            if (created)log->truncate();
+            else recover();
+            // the log is synced by the io writer ahead of each batch of write backs, not under the cache lock
+            file->set_before_write([this] { log->sync(); });
+        }
+        char buf[HEADER_SIZE];
         char* ptr = buf;
-        file.seekg(0);
-        file.read(buf, sizeof(buf));
+        file->read(0, buf, sizeof(buf));
+        memcpy(logged_header, buf, HEADER_SIZE);
 #define read_attribute(ATTR) memcpy((void*)&ATTR,ptr,sizeof(ATTR));ptr+=sizeof(ATTR)
         read_attribute(file_size);
         read_attribute(freelist_head);
         read_attribute(this->root);
+        // the header layout changed with the codec, older files read an unknown one
+        std::underlying_type<codec_t>::type recorded;
+        read_attribute(recorded);
 #undef read_attribute
+        if (recorded != CODEC_RAW && recorded != CODEC_DELTA)
+            throw std::runtime_error("LRUBPTree: "+path+" has an unknown header format");
+        codec = (codec_t) recorded;
+        // a compaction was cut short, the blocks it held are free
+        if (freelist_head == LOST_FREE)rebuild_freelist();
+        cache.set_counters(&this->counters);
+        this->set_top_index(options.top_index_nodes);
+        if (options.background_flush)
+            cache.start_flusher(options.clean_reserve, options.dirty_high_water,
+                                std::chrono::milliseconds(options.flush_interval_ms));
     }
 
-    template<typename KeyType,typename ValueType,typename WeakCmp>
-    LRUBPTree<KeyType,ValueType,WeakCmp>::~LRUBPTree() {
-#define write_attribute(ATTR) memcpy(ptr,(void*)&ATTR,sizeof(ATTR));ptr+=sizeof(ATTR)
-        char buf[sizeof(file_size)+sizeof(freelist_head)+sizeof(this->root)];
-        char* ptr = buf;
-        write_attribute(file_size);
-        write_attribute(freelist_head);
-        write_attribute(this->root);
-        file.seekg(0);
-        file.write(buf, sizeof(buf));
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    LRUBPTree<KeyType, ValueType, WeakCmp, Degree>::~LRUBPTree() {
+        if (log)checkpoint_unlocked();
         cache.destruct();
-        file.flush();
-        file.close();
-#undef write_attribute
+        file->drain();
+        if (!log) {
+            char buf[HEADER_SIZE];
+            header(buf);
+            file->write(0, buf, sizeof(buf));
+        }
     }
 }
 #endif //BPTREE_LRUBPTREE_H
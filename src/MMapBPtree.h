@@ -0,0 +1,208 @@
+#ifndef BPTREE_MMAPBPTREE_H
+#define BPTREE_MMAPBPTREE_H
+
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bptree.h"
+
+namespace bptree {
+    /*
+     *  Nodes live directly in a shared mapping of the file, loadNode is pointer arithmetic and saveNode is a no-op.
+     *  The file holds raw Node images and is not interchangeable with LRUBPTree files.
+     *  A range of max_size bytes of address space is reserved up front and the file is mapped into it
+     *  as it grows, so node pointers stay valid across growth.
+     */
+    template<typename KeyType, typename ValueType, typename WeakCmp=std::less<KeyType>,
+            size_t Degree = node_degree<KeyType, ValueType>()-1>     // the mapped Node keeps one spare entry
+    class MMapBPTree : public BPTree<KeyType, ValueType, WeakCmp, Degree> {
+    private:
+        typedef Node<KeyType, ValueType, Degree>* NodePtr;
+        static constexpr size_t NO_FREE = SIZE_MAX;
+        static constexpr uint64_t MAGIC = 0x4d4d415042505452ull;
+        static constexpr size_t PAGE = 4096;
+        static constexpr size_t MIN_GROWTH = 1 << 20;
+        // nodes are laid out at a page aligned stride
+        static constexpr size_t NODE_STRIDE = aligned_block_size(sizeof(Node<KeyType, ValueType, Degree>), PAGE);
+
+        struct Header {
+            uint64_t magic;
+            size_t file_size;   // end of the last node
+            DiskLoc_T freelist_head;
+            DiskLoc_T root;
+        };
+
+        int fd;
+        char* base;
+        size_t reserved;
+        size_t mapped;
+
+        Header* header() const { return reinterpret_cast<Header*>(base); }
+
+        void grow(size_t needed);
+
+        NodePtr initNode(typename Node<KeyType, ValueType, Degree>::type_t t) override;
+
+        void saveNode(NodePtr) override {}
+
+        NodePtr loadNode(DiskLoc_T offset) override { return reinterpret_cast<NodePtr>(base+offset); }
+
+        void deleteNode(NodePtr node) override;
+
+        void commitOp() override { header()->root = this->root; }
+
+        void prefetchNode(DiskLoc_T offset) override;
+
+        void prefetchNodes(const DiskLoc_T* offsets, size_t n) override;
+
+        size_t blockCount() override { return (header()->file_size-PAGE)/NODE_STRIDE; }
+
+        DiskLoc_T blockOffset(size_t i) override { return PAGE+i*NODE_STRIDE; }
+
+        void setBlocks(size_t n) override;
+
+    public:
+        static constexpr size_t DEFAULT_RESERVE = size_t(1) << 36;
+
+        MMapBPTree(const std::string& path, bool create = false, size_t max_size = DEFAULT_RESERVE);
+
+        /*
+         * sync: write dirty pages of the mapping back to the file
+         */
+        void sync();
+
+        ~MMapBPTree();
+    };
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void MMapBPTree<KeyType, ValueType, WeakCmp, Degree>::grow(size_t needed) {
+        if (needed <= mapped)return;
+        size_t target = std::max(needed, mapped+std::max(mapped, MIN_GROWTH));
+        target = (target+PAGE-1)/PAGE*PAGE;
+        if (target > reserved)throw std::runtime_error("MMapBPTree: reserved address space exhausted");
+        if (::ftruncate(fd, target))throw std::runtime_error("MMapBPTree: can't extend file");
+        // map only the new part, fixed right after the old one
+        void* p = ::mmap(base+mapped, target-mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, mapped);
+        if (p == MAP_FAILED)throw std::runtime_error("MMapBPTree: mmap failure");
+        ::madvise(base+mapped, target-mapped, MADV_RANDOM);
+        mapped = target;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    Node<KeyType, ValueType, Degree>* MMapBPTree<KeyType, ValueType, WeakCmp, Degree>::initNode(typename Node<KeyType, ValueType, Degree>::type_t t) {
+        Header* h = header();
+        NodePtr ptr;
+        if (h->freelist_head == NO_FREE) {
+            grow(h->file_size+NODE_STRIDE);
+            h = header();
+            ptr = loadNode(h->file_size);
+            ptr->offset = h->file_size;
+            h->file_size += NODE_STRIDE;
+        } else {
+            ptr = loadNode(h->freelist_head);
+            h->freelist_head = ptr->next;
+        }
+        ptr->type = t;
+        ptr->size = 0;
+        return ptr;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void MMapBPTree<KeyType, ValueType, WeakCmp, Degree>::deleteNode(NodePtr node) {
+        node->type = Node<KeyType, ValueType, Degree>::FREE;
+        node->next = header()->freelist_head;
+        header()->freelist_head = node->offset;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void MMapBPTree<KeyType, ValueType, WeakCmp, Degree>::setBlocks(size_t n) {
+        Header* h = header();
+        h->freelist_head = NO_FREE;
+        size_t end = blockOffset(n);
+        if (end >= h->file_size)return;
+        h->file_size = end;
+        size_t target = (end+PAGE-1)/PAGE*PAGE;
+        if (target >= mapped)return;
+        // hand the tail of the mapping back to the reservation, then cut the file under it
+        void* p = ::mmap(base+target, mapped-target, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        if (p == MAP_FAILED)throw std::runtime_error("MMapBPTree: mmap failure");
+        mapped = target;
+        if (::ftruncate(fd, target))throw std::runtime_error("MMapBPTree: can't truncate file");
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void MMapBPTree<KeyType, ValueType, WeakCmp, Degree>::prefetchNode(DiskLoc_T offset) {
+        // pull in the header and the first bisection probes, a syscall per hint would cost more than the miss
+        if (offset+sizeof(Node<KeyType, ValueType, Degree>) > mapped)return;
+        NodePtr node = loadNode(offset);
+        __builtin_prefetch(node);
+        __builtin_prefetch(node->K+Degree/4);
+        __builtin_prefetch(node->K+Degree/2);
+        __builtin_prefetch(node->K+3*Degree/4);
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void MMapBPTree<KeyType, ValueType, WeakCmp, Degree>::prefetchNodes(const DiskLoc_T* offsets, size_t n) {
+        // the mapping is MADV_RANDOM, so the kernel reads no further than the faulting page on its own.
+        // Cursors hint a batch of leaves at once, one madvise per run of adjacent ones
+        std::vector<DiskLoc_T> sorted(offsets, offsets+n);
+        std::sort(sorted.begin(), sorted.end());
+        for (size_t i = 0, j; i < sorted.size(); i = j) {
+            for (j = i+1; j < sorted.size() && sorted[j] == sorted[j-1]+NODE_STRIDE;)++j;
+            size_t begin = sorted[i]/PAGE*PAGE, end = std::min(sorted[j-1]+NODE_STRIDE, mapped);
+            if (begin < end)::madvise(base+begin, end-begin, MADV_WILLNEED);
+        }
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    MMapBPTree<KeyType, ValueType, WeakCmp, Degree>::MMapBPTree(const std::string& path, bool create, size_t max_size)
+            : BPTree<KeyType, ValueType, WeakCmp, Degree>(), reserved(max_size), mapped(0) {
+        fd = ::open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+        if (fd < 0)throw std::runtime_error("MMapBPTree: can't open "+path);
+        struct stat st{};
+        ::fstat(fd, &st);
+        void* p = ::mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("MMapBPTree: can't reserve address space");
+        }
+        base = static_cast<char*>(p);
+        if (!st.st_size) {
+            grow(PAGE);
+            Header* h = header();
+            h->magic = MAGIC;
+            // nodes start on the second page
+            h->file_size = PAGE;
+            h->freelist_head = NO_FREE;
+            h->root = Node<KeyType, ValueType, Degree>::NONE;
+        } else {
+            grow(st.st_size);
+            if (header()->magic != MAGIC) {
+                ::munmap(base, reserved);
+                ::close(fd);
+                throw std::runtime_error("MMapBPTree: "+path+" is not a tree file");
+            }
+        }
+        this->root = header()->root;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void MMapBPTree<KeyType, ValueType, WeakCmp, Degree>::sync() {
+        std::unique_lock<std::shared_mutex> guard(this->latch);
+        header()->root = this->root;
+        if (::msync(base, mapped, MS_SYNC))throw std::runtime_error("MMapBPTree: msync failure");
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    MMapBPTree<KeyType, ValueType, WeakCmp, Degree>::~MMapBPTree() {
+        header()->root = this->root;
+        ::msync(base, mapped, MS_SYNC);
+        ::munmap(base, reserved);
+        ::close(fd);
+    }
+}
+#endif //BPTREE_MMAPBPTREE_H
@@ -0,0 +1,92 @@
+#ifndef BPTREE_MEMBPTREE_H
+#define BPTREE_MEMBPTREE_H
+
+#include <memory>
+#include <vector>
+#include "bptree.h"
+
+namespace bptree {
+    /*
+     *  Nodes live in slabs of SLAB_NODES allocated on the heap, nothing is persisted.
+     *  A node's DiskLoc_T is its slot number, so loadNode is an index into the slab directory and saveNode is a no-op.
+     *  Deleted nodes go on a free list threaded through their next field and are handed out again first.
+     *  Slabs never move, so node pointers stay valid while slabs are added.
+     */
+    template<typename KeyType, typename ValueType, typename WeakCmp=std::less<KeyType>,
+            size_t Degree = node_degree<KeyType, ValueType>()>
+    class MemBPTree : public BPTree<KeyType, ValueType, WeakCmp, Degree> {
+    private:
+        typedef Node<KeyType, ValueType, Degree> NodeT;
+        typedef NodeT* NodePtr;
+        static constexpr size_t NO_FREE = SIZE_MAX;
+        static constexpr size_t SLAB_SHIFT = 6;
+        static constexpr size_t SLAB_NODES = size_t(1) << SLAB_SHIFT;
+
+        // only writers add or drop slabs, and they hold the tree exclusively
+        std::vector<std::unique_ptr<NodeT[]>> slabs;
+        size_t slots;   // slots handed out so far, free or not
+        DiskLoc_T freelist_head;
+
+        NodePtr initNode(typename NodeT::type_t t) override;
+
+        void saveNode(NodePtr) override {}
+
+        NodePtr loadNode(DiskLoc_T slot) override { return &slabs[slot >> SLAB_SHIFT][slot & (SLAB_NODES-1)]; }
+
+        void deleteNode(NodePtr node) override {
+            node->type = NodeT::FREE;
+            node->next = freelist_head;
+            freelist_head = node->offset;
+        }
+
+        void prefetchNode(DiskLoc_T slot) override {
+            // the header and the first bisection probes
+            NodePtr node = loadNode(slot);
+            __builtin_prefetch(node);
+            __builtin_prefetch(node->K+Degree/4);
+            __builtin_prefetch(node->K+Degree/2);
+            __builtin_prefetch(node->K+3*Degree/4);
+        }
+
+        // compaction packs the nodes into the first slots, so that scans walk memory in order, and frees the slabs behind
+        size_t blockCount() override { return slots; }
+
+        DiskLoc_T blockOffset(size_t i) override { return i; }
+
+        void setBlocks(size_t n) override;
+
+    public:
+        MemBPTree() : BPTree<KeyType, ValueType, WeakCmp, Degree>(), slots(0), freelist_head(NO_FREE) {}
+
+        // bytes held by the slabs
+        size_t memory() const {
+            std::shared_lock<std::shared_mutex> guard(this->latch);
+            return slabs.size()*SLAB_NODES*sizeof(NodeT);
+        }
+    };
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    Node<KeyType, ValueType, Degree>* MemBPTree<KeyType, ValueType, WeakCmp, Degree>::initNode(typename NodeT::type_t t) {
+        NodePtr ptr;
+        if (freelist_head != NO_FREE) {
+            ptr = loadNode(freelist_head);
+            freelist_head = ptr->next;
+        } else {
+            if (slots == slabs.size()*SLAB_NODES)slabs.emplace_back(new NodeT[SLAB_NODES]);
+            ptr = loadNode(slots);
+            ptr->offset = slots++;
+        }
+        ptr->type = t;
+        ptr->size = 0;
+        return ptr;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void MemBPTree<KeyType, ValueType, WeakCmp, Degree>::setBlocks(size_t n) {
+        freelist_head = NO_FREE;
+        if (n >= slots)return;
+        slots = n;
+        slabs.resize((n+SLAB_NODES-1)/SLAB_NODES);
+    }
+}
+#endif //BPTREE_MEMBPTREE_H
@@ -0,0 +1,203 @@
+#ifndef BPTREE_ANALYSIS_H
+#define BPTREE_ANALYSIS_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+
+namespace analysis {
+    /*
+     * Event counters of a tree and its backend.
+     * CACHE_EVICT counts blocks evicted to make room, CACHE_WRITEBACK those of them that were dirty.
+     * NODE_FLUSH counts every node write, whether from eviction, the flusher or a checkpoint.
+     */
+    typedef enum {
+        CACHE_HIT, CACHE_MISS, CACHE_EVICT, CACHE_WRITEBACK,
+        NODE_LOAD, NODE_FLUSH, BYTES_READ, BYTES_WRITTEN,
+        SPLIT, MERGE, BORROW,
+        COUNTER_COUNT
+    } counter_t;
+
+    const char* const COUNTER_NAMES[COUNTER_COUNT] = {
+            "cache_hit", "cache_miss", "cache_evict", "cache_writeback",
+            "node_load", "node_flush", "bytes_read", "bytes_written",
+            "split", "merge", "borrow"
+    };
+
+    // operations with a latency histogram, batches are timed per call
+    typedef enum {
+        OP_SEARCH, OP_INSERT, OP_REMOVE, OP_RANGE, OP_BATCH, OP_COUNT
+    } op_t;
+
+    const char* const OP_NAMES[OP_COUNT] = {"search", "insert", "remove", "range", "batch"};
+
+    /*
+     * Histogram: latencies in nanoseconds, two buckets per power of two
+     */
+    struct Histogram {
+        static const size_t BUCKETS = 80;
+        uint64_t bucket[BUCKETS];
+
+        static size_t index(uint64_t ns) {
+            if (ns < 2)return ns;
+            size_t e = 63-__builtin_clzll(ns);
+            size_t i = 2*e+((ns >> (e-1)) & 1);
+            return i < BUCKETS ? i : BUCKETS-1;
+        }
+
+        // the smallest latency of bucket i
+        static uint64_t lower(size_t i) {
+            if (i < 2)return i;
+            return (uint64_t(2+(i & 1)) << (i/2)) >> 1;
+        }
+
+        uint64_t count() const {
+            uint64_t n = 0;
+            for (uint64_t b : bucket)n += b;
+            return n;
+        }
+
+        // @return an upper bound of the p quantile in nanoseconds, 0 when empty
+        uint64_t percentile(double p) const {
+            uint64_t n = count(), seen = 0;
+            if (!n)return 0;
+            auto rank = (uint64_t) (p*(double) n);
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                seen += bucket[i];
+                if (seen > rank || seen == n)return i+1 < BUCKETS ? lower(i+1)-1 : lower(i);
+            }
+            return 0;
+        }
+    };
+
+    /*
+     * Snapshot: counters summed over all threads at one point, latency histograms when they are on,
+     * and the shape of the tree, which the tree fills in
+     */
+    struct Snapshot {
+        uint64_t counter[COUNTER_COUNT] = {};
+        bool has_latency = false;
+        Histogram latency[OP_COUNT] = {};
+        int height = 0;
+        uint64_t leaves = 0, pairs = 0;
+        // pairs over the capacity of the leaves
+        double fill_factor = 0;
+
+        uint64_t operator[](counter_t c) const { return counter[c]; }
+    };
+
+    /*
+     * Counters: each thread adds to a stripe of its own, padded to a cache line, so that counting on a hot path
+     * never bounces a line between cores. Threads beyond STRIPES share stripes. A snapshot sums the stripes
+     * with relaxed loads and takes no lock, so an exporter may read it at any time.
+     */
+    class Counters {
+    public:
+        static const size_t STRIPES = 32;
+
+    private:
+        struct alignas(64) Stripe {
+            std::atomic<uint64_t> value[COUNTER_COUNT];
+        };
+
+        struct alignas(64) Latency {
+            std::atomic<uint64_t> bucket[OP_COUNT][Histogram::BUCKETS];
+        };
+
+        std::unique_ptr<Stripe[]> stripes;
+        // allocated the first time latencies are turned on, kept until the end
+        std::atomic<Latency*> latency;
+        std::atomic<bool> latency_on;
+
+        static size_t stripe() {
+            static std::atomic<size_t> next(0);
+            thread_local size_t mine = next.fetch_add(1, std::memory_order_relaxed)%STRIPES;
+            return mine;
+        }
+
+        void clear_latency(Latency* l) {
+            for (size_t s = 0; s < STRIPES; ++s)
+                for (auto& op : l[s].bucket)
+                    for (auto& b : op)b.store(0, std::memory_order_relaxed);
+        }
+
+    public:
+        Counters() : stripes(new Stripe[STRIPES]), latency(nullptr), latency_on(false) { reset(); }
+
+        Counters(const Counters&) = delete;
+
+        Counters& operator=(const Counters&) = delete;
+
+        ~Counters() { delete[] latency.load(); }
+
+        void add(counter_t c, uint64_t n = 1) {
+            stripes[stripe()].value[c].fetch_add(n, std::memory_order_relaxed);
+        }
+
+        bool timing() const { return latency_on.load(std::memory_order_relaxed); }
+
+        void set_latency(bool on) {
+            if (on && !latency.load()) {
+                auto l = new Latency[STRIPES];
+                clear_latency(l);
+                Latency* expected = nullptr;
+                if (!latency.compare_exchange_strong(expected, l))delete[] l;
+            }
+            latency_on.store(on, std::memory_order_relaxed);
+        }
+
+        void record(op_t op, uint64_t ns) {
+            Latency* l = latency.load(std::memory_order_acquire);
+            if (l)l[stripe()].bucket[op][Histogram::index(ns)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // counts from before are dropped, events racing with the reset may land on either side
+        void reset() {
+            for (size_t s = 0; s < STRIPES; ++s)
+                for (auto& v : stripes[s].value)v.store(0, std::memory_order_relaxed);
+            if (Latency* l = latency.load())clear_latency(l);
+        }
+
+        void snapshot(Snapshot& out) const {
+            for (size_t c = 0; c < COUNTER_COUNT; ++c) {
+                out.counter[c] = 0;
+                for (size_t s = 0; s < STRIPES; ++s)out.counter[c] += stripes[s].value[c].load(std::memory_order_relaxed);
+            }
+            Latency* l = latency.load(std::memory_order_acquire);
+            out.has_latency = l && timing();
+            if (!out.has_latency)return;
+            for (size_t op = 0; op < OP_COUNT; ++op)
+                for (size_t b = 0; b < Histogram::BUCKETS; ++b) {
+                    out.latency[op].bucket[b] = 0;
+                    for (size_t s = 0; s < STRIPES; ++s)
+                        out.latency[op].bucket[b] += l[s].bucket[op][b].load(std::memory_order_relaxed);
+                }
+        }
+    };
+
+    /*
+     * Timer: records the lifetime of the scope as an op, reads the clock only while latencies are on
+     */
+    class Timer {
+        Counters* counters;
+        op_t op;
+        std::chrono::steady_clock::time_point start;
+    public:
+        Timer(Counters& c, op_t op) : counters(c.timing() ? &c : nullptr), op(op) {
+            if (counters)start = std::chrono::steady_clock::now();
+        }
+
+        Timer(const Timer&) = delete;
+
+        Timer& operator=(const Timer&) = delete;
+
+        ~Timer() {
+            if (!counters)return;
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start);
+            counters->record(op, (uint64_t) ns.count());
+        }
+    };
+}
+#endif //BPTREE_ANALYSIS_H
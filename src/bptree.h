@@ -5,7 +5,21 @@
 #include <memory>
 #include <cstring>
 #include <algorithm>
+#include <vector>
+#include <map>
+#include <set>
+#include <numeric>
+#include <cmath>
+#include <stdexcept>
+#include <exception>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <functional>
+#include <thread>
 #include "analysis.h"
+#include "search.h"
+#include "key.h"
 
 using std::tie;
 using std::lower_bound;
@@ -15,24 +29,88 @@ using std::move_backward;
 
 namespace bptree {
     typedef uint64_t DiskLoc_T;
-    const size_t DEGREE = 101;
-    const size_t INTERNAL_MIN_ENTRY = (DEGREE-1)/2;
-    const size_t LEAF_MIN_ENTRY = (DEGREE/2);
-    const size_t INTERNAL_MAX_ENTRY = DEGREE-1;
-    const size_t LEAF_MAX_ENTRY = DEGREE;
+    const size_t DEFAULT_PAGE_SIZE = 4096;
     /*
      *  KeyType needs  to be copyable without destructor, comparable and no duplication
      *  ValueType needs copyable without destructor
+     *  Variable length keys (VarKey) are bounded by bytes as well, see key.h
      */
     const size_t STACK_DEPTH = 20;
+    // type, offset, next, prev and size in front of the entries of a serialized node
+    const size_t NODE_HEADER_SIZE = sizeof(int)+3*sizeof(DiskLoc_T)+sizeof(size_t);
 
+    /*
+     * Built with BPTREE_ORDER_STATS, internal nodes also keep the number of pairs under each child,
+     * which count(), rank() and select() walk down. Every child entry grows by the count, so the default
+     * fan-out shrinks, and tree files written with and without it can't be opened by the other.
+     */
+#ifdef BPTREE_ORDER_STATS
+    const bool ORDER_STATS = true;
+#else
+    const bool ORDER_STATS = false;
+#endif
+    // a child entry of a serialized internal node
+    const size_t CHILD_SIZE = sizeof(DiskLoc_T)+(ORDER_STATS ? sizeof(uint64_t) : 0);
+    // bytes a variable length key is expected to take once prefix compressed, sizes their default fan-out
+    const size_t VAR_KEY_BYTES = 8;
+
+    /*
+     * node_degree: the largest fan-out whose serialized node fits in page_size bytes.
+     * Small pages suit point lookups, large ones suit scans:
+     * LRUBPTree<K, V, std::less<K>, node_degree<K, V>(16384)>
+     */
+    template<typename KeyType, typename ValueType>
+    constexpr size_t node_degree(size_t page_size = DEFAULT_PAGE_SIZE) {
+        return (page_size-NODE_HEADER_SIZE)/((key_traits<KeyType>::variable ? 1+VAR_KEY_BYTES : sizeof(KeyType))
+                                             +std::max(sizeof(ValueType), CHILD_SIZE));
+    }
+
+    /*
+     * aligned_block_size: blocks below a page are rounded up to a power of two, larger ones to whole pages,
+     * so that a block at a multiple of its size never straddles a page
+     */
+    constexpr size_t aligned_block_size(size_t bytes, size_t page_size = DEFAULT_PAGE_SIZE) {
+        if (bytes >= page_size)return (bytes+page_size-1)/page_size*page_size;
+        size_t n = 1;
+        while (n < bytes)n <<= 1;
+        return n;
+    }
+
+    /*
+     * A child slot of a cached internal node may hold a swizzled reference instead of the bare offset:
+     * the top bit, the cache slot the child was last found in, then the offset. The slot is only a hint,
+     * checked against the offset when the child is loaded, so eviction leaves parents alone.
+     * Nodes are always written with bare offsets.
+     */
+    const DiskLoc_T SWIZZLED = 1ull << 63;
+    const unsigned SWIZZLE_OFFSET_BITS = 40;
+    const DiskLoc_T SWIZZLE_OFFSET_MASK = (1ull << SWIZZLE_OFFSET_BITS)-1;
 
-    template<typename KeyType, typename ValueType, typename WeakCmp=std::less<KeyType>>
+    inline DiskLoc_T unswizzle(DiskLoc_T ref) { return ref & SWIZZLED ? ref & SWIZZLE_OFFSET_MASK : ref; }
+
+    // 0 when ref is a bare offset
+    inline size_t swizzled_slot(DiskLoc_T ref) { return ref & SWIZZLED ? (ref & ~SWIZZLED) >> SWIZZLE_OFFSET_BITS : 0; }
+
+    // the bare offset when either doesn't fit
+    inline DiskLoc_T swizzle(DiskLoc_T offset, size_t slot) {
+        if (offset > SWIZZLE_OFFSET_MASK || slot >> (63-SWIZZLE_OFFSET_BITS))return offset;
+        return SWIZZLED | (DiskLoc_T) slot << SWIZZLE_OFFSET_BITS | offset;
+    }
+
+
+    template<typename KeyType, typename ValueType, size_t Degree = node_degree<KeyType, ValueType>()>
     struct Node {
         /*
          *  for internal node, max=DEGREE-1, min=floor((DEGREE-1)/2)
          *  for leaf node, max=DEGREE, min=floor(DEGREE/2)
          */
+        static_assert(Degree >= 3, "Node: Degree must be at least 3");
+        const static size_t DEGREE = Degree;
+        const static size_t INTERNAL_MIN_ENTRY = (DEGREE-1)/2;
+        const static size_t LEAF_MIN_ENTRY = (DEGREE/2);
+        const static size_t INTERNAL_MAX_ENTRY = DEGREE-1;
+        const static size_t LEAF_MAX_ENTRY = DEGREE;
+
         const static DiskLoc_T NONE = SIZE_MAX;
         typedef enum {
             FREE, LEAF, INTERNAL
@@ -51,71 +129,363 @@ namespace bptree {
             ValueType V[DEGREE+1];
             DiskLoc_T sub_nodes[DEGREE+1];  // more space for easier implementation of insert
         };
+#ifdef BPTREE_ORDER_STATS
+        uint64_t counts[DEGREE+1];  // pairs under sub_nodes[i]
+#endif
         Node(){}
 
 
         const static size_t LEAF_SIZE = sizeof(type)+sizeof(offset)+sizeof(next)
                                         +sizeof(prev)+sizeof(size)+sizeof(KeyType)*DEGREE+sizeof(ValueType)*DEGREE;
         const static size_t INTERNAL_SIZE = sizeof(type)+sizeof(offset)+sizeof(next)
-                                            +sizeof(prev)+sizeof(size)+sizeof(KeyType)*DEGREE+sizeof(DiskLoc_T)*DEGREE;
-        const static size_t BLOCK_SIZE = std::max(LEAF_SIZE, INTERNAL_SIZE);
+                                            +sizeof(prev)+sizeof(size)+sizeof(KeyType)*DEGREE+CHILD_SIZE*DEGREE;
+        // the largest entry, nodes of variable length keys hold at least four so that an overfull one splits in two
+        const static size_t MAX_ENTRY_SIZE = key_traits<KeyType>::MAX_BYTES+std::max(sizeof(ValueType), CHILD_SIZE);
+        const static size_t VAR_SIZE = std::max(NODE_HEADER_SIZE+DEGREE*(1+VAR_KEY_BYTES+std::max(sizeof(ValueType), CHILD_SIZE)),
+                                                NODE_HEADER_SIZE+1+CHILD_SIZE+4*MAX_ENTRY_SIZE);
+        // on-disk size, padded so that blocks line up with pages
+        const static size_t BLOCK_SIZE = aligned_block_size(key_traits<KeyType>::variable ? VAR_SIZE : std::max(LEAF_SIZE, INTERNAL_SIZE));
+
+        // bytes of the serialized node of variable length keys, see writeBuffer
+        static size_t encoded_size(const Node* node) {
+            size_t entries = node->type == LEAF ? node->size*sizeof(ValueType) : (node->size+1)*CHILD_SIZE;
+            return NODE_HEADER_SIZE+key_traits<KeyType>::encoded_size(node->K, node->size)+entries;
+        }
     };
 
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    void writeBuffer(Node<KeyType, ValueType>* node, char* buf);
+    template<typename KeyType, typename ValueType, size_t Degree>
+    void writeBuffer(const Node<KeyType, ValueType, Degree>* node, char* buf);
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    void readBuffer(Node<KeyType, ValueType>* node, char* cuf);
+    template<typename KeyType, typename ValueType, size_t Degree>
+    void readBuffer(Node<KeyType, ValueType, Degree>* node, char* cuf);
 
 
     /*
      * Key is repeatable but no duplicated Key-Value pair
      */
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree = node_degree<KeyType, ValueType>()>
     class BPTree {
     private:
         enum {
             LEFT, RIGHT
         };
+        typedef Node<KeyType, ValueType, Degree> NodeT;
+        typedef KeySearch<KeyType, WeakCmp> Search;
+        static const size_t DEGREE = NodeT::DEGREE;
+        static const size_t INTERNAL_MIN_ENTRY = NodeT::INTERNAL_MIN_ENTRY;
+        static const size_t LEAF_MIN_ENTRY = NodeT::LEAF_MIN_ENTRY;
+        static const size_t INTERNAL_MAX_ENTRY = NodeT::INTERNAL_MAX_ENTRY;
+        static const size_t LEAF_MAX_ENTRY = NodeT::LEAF_MAX_ENTRY;
         static const int NO_PARENT = -1;
+        // an operation holds its path plus at most two siblings per level and a few new nodes
+        static const size_t HELD_MAX = 4*STACK_DEPTH;
+        // node copies kept for open snapshots by default, see set_version_limit
+        static const size_t VERSION_LIMIT = 1 << 16;
+        // how far ahead in the batch multi_search prefetches leaves
+        static const size_t PREFETCH_AHEAD = 4;
+        // the most leaves a cursor hints ahead of itself, its window doubles up to this while it keeps going
+        static constexpr size_t READ_AHEAD_MAX = 64;
+        static const bool VARIABLE = key_traits<KeyType>::variable;
+        static_assert(!VARIABLE || std::is_same<WeakCmp, std::less<KeyType>>::value,
+                      "BPTree: variable length keys are compressed by prefix, they must be ordered bytewise");
+
+        typedef Node<KeyType, ValueType, Degree>* NodePtr;
+
+        /*
+         * Per-call traversal state, so that concurrent calls don't share stacks.
+         * Every node handed out through load()/create() is released when the Path goes out of scope.
+         */
+        struct Path {
+            BPTree* tree;
+            bool writer;    // commit the modification before releasing its nodes
+            NodePtr nodes[STACK_DEPTH];
+            int offsets[STACK_DEPTH];
+            NodePtr held[HELD_MAX];
+            size_t held_count;
+            // with snapshots open, a writer's nodes as they were when first held
+            bool versioned;
+            std::vector<std::unique_ptr<NodeT>> before;
+
+            explicit Path(BPTree* t, bool w = false) : tree(t), writer(w), held_count(0), versioned(w && t->versioning()) {
+                offsets[0] = NO_PARENT;
+            }
+
+            Path(const Path&) = delete;
+
+            Path& operator=(const Path&) = delete;
+
+            ~Path() {
+                if (writer && !std::uncaught_exceptions()) {
+                    if (versioned)tree->keep_versions(*this);
+                    tree->commitOp();
+                    ++tree->changes;
+                }
+                for (size_t i = 0; i < held_count; ++i)tree->releaseNode(held[i]);
+            }
+
+            NodePtr hold(NodePtr node) {
+                if (held_count == HELD_MAX)throw std::logic_error("BPTree: too many nodes held by one operation");
+                if (versioned && std::none_of(held, held+held_count, [node](NodePtr h) { return h == node; })) {
+                    before.emplace_back(new NodeT);
+                    copy_node(before.back().get(), node);
+                }
+                return held[held_count++] = node;
+            }
+        };
+
+        // declared ahead of a writer's latch guard, so that syncOp runs once the latch is released
+        struct OpSync {
+            BPTree* tree;
+
+            explicit OpSync(BPTree* t) : tree(t) {}
+
+            OpSync(const OpSync&) = delete;
+
+            OpSync& operator=(const OpSync&) = delete;
+
+            ~OpSync() noexcept(false) {
+                if (!std::uncaught_exceptions())tree->syncOp();
+            }
+        };
+
+        /*
+         * TopIndex: the separators of the internal levels above depth, flattened into one sorted array.
+         * Node targets[i] at depth covers the keys between separators i-1 and i, so a search starts there.
+         * Readers build it on demand, writers drop it when they change a node above depth.
+         */
+        struct TopIndex {
+            Eytzinger<KeyType, WeakCmp> separators;
+            std::vector<DiskLoc_T> targets;
+            int depth;
+        };
 
-        typedef Node<KeyType, ValueType>* NodePtr;
         /*
          * data member
          */
-        NodePtr path_stack[STACK_DEPTH];
-        int in_node_offset_stack[STACK_DEPTH]{};
         WeakCmp les;
+        // (offset, version) -> the node before its first change at that version, while a snapshot older needs it
+        std::map<std::pair<DiskLoc_T, uint64_t>, std::unique_ptr<NodeT>> versions;
+        std::multiset<uint64_t> snapshots;
+        // snapshots given up to keep versions within version_limit nodes, reads through them throw
+        std::set<uint64_t> expired;
+        size_t version_limit;
+        uint64_t version;
+        std::mutex versions_lock;
+
+        bool versioning() {
+            std::lock_guard<std::mutex> guard(versions_lock);
+            return !snapshots.empty();
+        }
+
+        void keep_versions(Path& path);
+        void read_version(DiskLoc_T ref, uint64_t at, NodeT* out);
+        void close_snapshot(uint64_t at);
+        // drop the versions no open snapshot needs any more, versions_lock held
+        void drop_versions();
+
+        // the live part of src, child slots unswizzled
+        static void copy_node(NodeT* dst, const NodeT* src);
+        static bool same_node(const NodeT* a, const NodeT* b);
+
+        std::atomic<TopIndex*> top;
+        std::mutex top_lock;
+        size_t top_nodes;
+
+        DiskLoc_T top_target(const KeyType& key, bool lower);
+        TopIndex* build_top();
+
+        // a writer changed a node at depth, which the index may cover. Readers are shut out, so it can go at once
+        void top_changed(int depth) {
+            TopIndex* t = top.load(std::memory_order_relaxed);
+            if (t && depth < t->depth)drop_top();
+        }
+
+        /*
+         * Layout: the live nodes as compact() last scanned them, each named by the block it was found in.
+         * order[i] is the node going to block i, loc[n] the block n is in now, at[b] the node in block b,
+         * NO_BLOCK when free, and parent[n] the parent of n.
+         */
+        struct Layout {
+            std::vector<size_t> order, loc, at, parent;
+        };
+        static constexpr size_t NO_BLOCK = SIZE_MAX;
+        // committed writer operations, compact() rescans when writers ran between its steps
+        uint64_t changes;
+        // kept by writers, but only right once the first stats() has counted the leaves of an opened tree
+        uint64_t leaf_count, pair_count;
+        bool shape_known;
+
+        // levels from the root to the leaves, 0 when empty
+        int height();
+        void count_leaves();
+
+        size_t block_of(DiskLoc_T offset) { return (offset-blockOffset(0))/(blockOffset(1)-blockOffset(0)); }
+
+        void scan_layout(Layout& layout, size_t placed);
+        void move_node(Layout& layout, size_t slot, NodeT* spare);
+        size_t finish_compaction(const Layout& layout);
+
+        NodePtr load(Path& path, DiskLoc_T offset) { return path.hold(loadNode(offset)); }
+
+        NodePtr load(Path& path, NodePtr parent, size_t i) { return path.hold(loadChild(parent, i)); }
+
+        NodePtr create(Path& path, typename Node<KeyType, ValueType, Degree>::type_t t) {
+            if (t == NodeT::LEAF)++leaf_count;
+            return path.hold(initNode(t));
+        }
+
+        void discard(Path&, NodePtr node) {
+            if (node->type == NodeT::LEAF)--leaf_count;
+            // a deleted node stays held, backends release it like any other
+            deleteNode(node);
+        }
 
-        int basic_search(const KeyType& key);
+        int basic_search(Path& path, const KeyType& key);
+        // the leaf is pinned, and its parent too when asked for and there is one
+        NodePtr find_leaf(const KeyType& key, bool lower, NodePtr* parent = nullptr, size_t* slot = nullptr);
+        NodePtr leaf_parent(NodePtr leaf, size_t& slot);
 
         size_t insert_inplace(NodePtr& node, const KeyType& key, const ValueType& value);
         size_t insert_key_inplace(NodePtr& node, const KeyType& key, DiskLoc_T offset);
-        std::tuple<KeyType, DiskLoc_T> insert_key(NodePtr& node, const KeyType& key, DiskLoc_T offset);
+        std::tuple<KeyType, NodePtr> split_keys(Path& path, NodePtr& node);
+
+        /*
+         * With ORDER_STATS, counts[i] of an internal node is the number of pairs under its child i.
+         * A writer adds what it inserted or removed to the counts along its path first,
+         * splits, borrows and merges then move counts along with the children and recount the slots they change.
+         */
+        static uint64_t subtree(const NodeT* node) {
+            if (node->type == NodeT::LEAF)return node->size;
+            uint64_t n = 0;
+            if constexpr (ORDER_STATS) n = std::accumulate(node->counts, node->counts+node->size+1, uint64_t(0));
+            return n;
+        }
+
+        // path.nodes[index] gained delta pairs
+        void add_count(Path& path, int index, int64_t delta) {
+            if constexpr (ORDER_STATS)
+                for (; index > 0; --index) {
+                    path.nodes[index-1]->counts[path.offsets[index]] += delta;
+                    saveNode(path.nodes[index-1]);
+                }
+        }
+
+        static void set_count(NodePtr parent, size_t slot, const NodeT* child) {
+            if constexpr (ORDER_STATS) parent->counts[slot] = subtree(child);
+        }
+
+        // path.nodes[index] borrowed from its neighbour on the direction side
+        static void recount_borrow(Path& path, int index, NodePtr nearby, int direction) {
+            if constexpr (ORDER_STATS) {
+                size_t slot = path.offsets[index];
+                set_count(path.nodes[index-1], slot, path.nodes[index]);
+                set_count(path.nodes[index-1], LEFT == direction ? slot-1 : slot+1, nearby);
+            }
+        }
+
+        // the pairs with keys below key, or up to key with upper
+        uint64_t rank_of(const KeyType& key, bool upper);
 
         bool remove_inplace(NodePtr& node, const KeyType& key);
         void remove_offset_inplace(NodePtr& node, KeyType key, DiskLoc_T offset);
-        bool borrow_key(int index);
-        bool borrow_value(int index);
-        DiskLoc_T merge_values(NodePtr& target, NodePtr& tobe, int direction);
-        DiskLoc_T merge_keys(KeyType mid_key, NodePtr& target, NodePtr& tobe, int direction);
+        bool borrow_key(Path& path, int index);
+        bool borrow_value(Path& path, int index);
+        DiskLoc_T merge_values(Path& path, NodePtr& target, NodePtr& tobe, int direction);
+        DiskLoc_T merge_keys(Path& path, KeyType mid_key, NodePtr& target, NodePtr& tobe, int direction);
+
+        void link_leaf(Path& path, NodePtr cur, NodePtr new_node);
+        void insert_into_parents(Path& path, int index, KeyType key, NodePtr sibling);
+        void rebalance_leaf(Path& path, int index);
 
-        KeyType& find_mid_key(int index, int direction) const {
-            return (LEFT == direction) ? (path_stack[index-1]->K[in_node_offset_stack[index]-1]) :
-                   (path_stack[index-1]->K[in_node_offset_stack[index]]);
+        // the leaf at path.nodes[index] holds the keys below this separator, nullptr for the last leaf
+        static const KeyType* leaf_fence(const Path& path, int index) {
+            for (; index > 0; --index)
+                if (path.offsets[index] < (int) path.nodes[index-1]->size)
+                    return path.nodes[index-1]->K+path.offsets[index];
+            return nullptr;
         }
 
+        static KeyType& find_mid_key(const Path& path, int index, int direction) {
+            return (LEFT == direction) ? (path.nodes[index-1]->K[path.offsets[index]-1]) :
+                   (path.nodes[index-1]->K[path.offsets[index]]);
+        }
+
+
+        NodePtr getLeft(Path& path, int index) {
+            return path.offsets[index] ? load(path, path.nodes[index-1], path.offsets[index]-1) : nullptr;
+        }
+
+        /*
+         * Nodes hold at most LEAF_MAX_ENTRY/INTERNAL_MAX_ENTRY entries and, with variable length keys, no more
+         * than their block once encoded. Those rebalance by bytes: a node under a quarter of its block
+         * merges with a sibling when the result fits, and never borrows.
+         */
+        static bool overfull(NodePtr node) {
+            size_t max = node->type == NodeT::LEAF ? LEAF_MAX_ENTRY : INTERNAL_MAX_ENTRY;
+            if constexpr (VARIABLE) return node->size > max || NodeT::encoded_size(node) > NodeT::BLOCK_SIZE;
+            else return node->size > max;
+        }
+
+        static bool underfull(NodePtr node) {
+            if constexpr (VARIABLE) return NodeT::encoded_size(node) < NodeT::BLOCK_SIZE/4;
+            else return node->size < (node->type == NodeT::LEAF ? LEAF_MIN_ENTRY : INTERNAL_MIN_ENTRY);
+        }
+
+        // encoded size of a node assembled key by key, for variable length keys
+        struct Encoding {
+            bool leaf;
+            size_t prefix = 0, bytes = 0, count = 0;
+            KeyType anchor;
+
+            explicit Encoding(bool leaf) : leaf(leaf) {}
+
+            Encoding& add(const KeyType& key) {
+                prefix = count++ ? std::min(prefix, key_traits<KeyType>::common_prefix(anchor, key)) : key.size();
+                if (count == 1)anchor = key;
+                bytes += 1+key.size()+(leaf ? sizeof(ValueType) : CHILD_SIZE);
+                return *this;
+            }
+
+            size_t size() const { return NODE_HEADER_SIZE+1+prefix+bytes-count*prefix+(leaf ? 0 : CHILD_SIZE); }
+        };
 
-        NodePtr getLeft(int index) {
-            return in_node_offset_stack[index] ? loadNode(path_stack[index-1]->sub_nodes[in_node_offset_stack[index]-1])
-                                               : nullptr;
+        // whether left, then mid for internal nodes, then right fit one node
+        static bool mergeable(NodePtr left, NodePtr right, const KeyType* mid = nullptr) {
+            if constexpr (VARIABLE) {
+                if (left->size+right->size+(mid ? 1 : 0) > (mid ? INTERNAL_MAX_ENTRY : LEAF_MAX_ENTRY))return false;
+                Encoding e(!mid);
+                for (size_t i = 0; i < left->size; ++i)e.add(left->K[i]);
+                if (mid)e.add(*mid);
+                for (size_t i = 0; i < right->size; ++i)e.add(right->K[i]);
+                return e.size() <= NodeT::BLOCK_SIZE;
+            } else return true;
         }
 
-        NodePtr getRight(int index) {
-            return in_node_offset_stack[index] != path_stack[index-1]->size ? loadNode(
-                    path_stack[index-1]->sub_nodes[in_node_offset_stack[index]+1]) : nullptr;
+        /*
+         * split_at: where an overfull node of n keys splits. Leaves keep [0, at) and move the rest right,
+         * internal nodes also move key at up. Variable length keys split where the larger half is smallest.
+         */
+        static size_t split_at(const KeyType* keys, size_t n, bool leaf, size_t fixed) {
+            if constexpr (VARIABLE) return byte_split(keys, n, leaf);
+            else return fixed;
+        }
+
+        static size_t byte_split(const KeyType* keys, size_t n, bool leaf);
+
+        static size_t byte_group(NodePtr leaf, const std::vector<std::pair<KeyType, ValueType>>& batch, size_t i, size_t end);
+
+        static size_t hardware_parts() { return std::max(std::thread::hardware_concurrency(), 1u); }
+
+        static size_t fill_count(double fill_factor, size_t min_entry, size_t max_entry) {
+            auto n = (size_t) std::ceil(fill_factor*max_entry);
+            return std::min(std::max({n, min_entry, (size_t) 1}), max_entry);
+        }
+
+        NodePtr getRight(Path& path, int index) {
+            return path.offsets[index] != (int) path.nodes[index-1]->size
+                   ? load(path, path.nodes[index-1], path.offsets[index]+1) : nullptr;
         }
 
 
@@ -123,64 +493,486 @@ namespace bptree {
         virtual void saveNode(NodePtr node) = 0;;
         virtual void deleteNode(NodePtr node) = 0;
         virtual NodePtr loadNode(DiskLoc_T offset) = 0;
-        virtual NodePtr initNode(typename Node<KeyType, ValueType>::type_t t) = 0;
+        virtual NodePtr initNode(typename Node<KeyType, ValueType, Degree>::type_t t) = 0;
+
+        /*
+         * loadChild: loadNode of the i-th child of a loaded internal node.
+         * Backends may swizzle the slot, concurrent readers read it with child()
+         */
+        virtual NodePtr loadChild(NodePtr parent, size_t i) { return loadNode(parent->sub_nodes[i]); }
+
+        static DiskLoc_T child(const Node<KeyType, ValueType, Degree>* parent, size_t i) {
+            return __atomic_load_n(&parent->sub_nodes[i], __ATOMIC_RELAXED);
+        }
+
+        /*
+         * releaseNode: the caller is done with a node returned by loadNode/initNode,
+         * backends that pin nodes in memory may drop the pin now
+         */
+        virtual void releaseNode(NodePtr) {}
+
+        /*
+         * commitOp: a modification is complete, every node saved since the last call is consistent
+         * and still held. Called before the nodes of insert/remove are released, and per node by bulk_load.
+         */
+        virtual void commitOp() {}
+
+        /*
+         * syncOp: a writer released the tree after its commits, backends make them durable here
+         * so that writers that queued on the latch meanwhile share the sync
+         */
+        virtual void syncOp() {}
+
+        /*
+         * prefetchNode: a hint that a scan is about to load offset
+         * prefetchNodes: the same for the next leaves of a scan, in scan order, so that they can be read as one
+         */
+        virtual void prefetchNode(DiskLoc_T) {}
+
+        virtual void prefetchNodes(const DiskLoc_T* offsets, size_t n) {
+            for (size_t i = 0; i < n; ++i)prefetchNode(offsets[i]);
+        }
+
+        /*
+         * Compaction: the file holds blockCount() node blocks, block i at blockOffset(i).
+         * setBlocks(n) empties the freelist and ends the file after its first n blocks, dropping the rest.
+         * From the first setBlocks until compacted() the freelist misses blocks, a backend that persists it
+         * must not record it as complete in between.
+         */
+        virtual size_t blockCount() { throw std::logic_error("BPTree: the backend can't compact"); }
+
+        virtual DiskLoc_T blockOffset(size_t) { return Node<KeyType, ValueType, Degree>::NONE; }
+
+        virtual void setBlocks(size_t) {}
+
+        virtual void compacted() {}
+
+        // the root changed or nodes moved, taken exclusively
+        void drop_top() { delete top.exchange(nullptr); }
 
         /*
          * maintain structure
          */
         DiskLoc_T root;
+        mutable std::shared_mutex latch;
+        // events of the tree and of its backend, see stats()
+        analysis::Counters counters;
     public:
-        BPTree(const WeakCmp& cmp=WeakCmp()) : root(Node<KeyType, ValueType>::NONE),les(cmp) {
-            in_node_offset_stack[0] = NO_PARENT;
-            for (auto& i : path_stack)i = nullptr;
+        BPTree(const WeakCmp& cmp=WeakCmp()) : les(cmp), version_limit(VERSION_LIMIT), version(0), top(nullptr), top_nodes(0), changes(0),
+                                               leaf_count(0), pair_count(0), shape_known(false),
+                                               root(Node<KeyType, ValueType, Degree>::NONE) {}
+
+        BPTree(const BPTree&) = delete;
+
+        BPTree& operator=(const BPTree&) = delete;
+
+        /*
+         * set_top_index: keep the separators of up to max_nodes internal nodes of the upper levels in memory,
+         * searches and cursors then load the first node below them straight away instead of walking down to it.
+         * The index reaches down to the parents of leaves at most, so leaf splits leave it alone.
+         * 0, the default, turns it off.
+         */
+        void set_top_index(size_t max_nodes) {
+            std::unique_lock<std::shared_mutex> guard(latch);
+            top_nodes = max_nodes;
+            drop_top();
+        }
+
+        /*
+         * set_version_limit: keep at most max_nodes node copies for open snapshots, VERSION_LIMIT by default.
+         * A write that goes past it expires the oldest snapshots until the copies fit, see Snapshot.
+         */
+        void set_version_limit(size_t max_nodes) {
+            std::lock_guard<std::mutex> guard(versions_lock);
+            version_limit = max_nodes;
         }
 
+        /*
+         * Thread safety: search, range and cursors may run concurrently with each other,
+         * insert, remove and bulk_load take the tree exclusively. One tree-wide latch does both, there is
+         * no per-node latch crabbing, so a write blocks every reader while it runs. Readers pin at most
+         * a node and its parent on the way down, and wait for a block of a full cache to be unpinned.
+         */
+
         /*
          *  search: if not found, pair.second = false
          *  @todo process same key
          */
         std::pair<ValueType, bool> search(const KeyType& key);
 
+        /*
+         * multi_search: search keys[0, count), results come back in input order.
+         * The batch is walked in key order and each descent restarts from the lowest node still covering the key.
+         */
+        std::vector<std::pair<ValueType, bool>> multi_search(const KeyType* keys, size_t count);
+
+        std::vector<std::pair<ValueType, bool>> multi_search(const std::vector<KeyType>& keys) {
+            return multi_search(keys.data(), keys.size());
+        }
+
         void insert(const KeyType& key, const ValueType& value);
 
         bool remove(const KeyType& key);
 
         /*
-         * range: low <= key < high
+         * insert_batch: insert the pairs of [first, last) in any order. They are sorted and merged into
+         * their leaf a group at a time, so each leaf is searched, rewritten and saved once per group and split at most once.
+         * With replace, a pair whose key is already present overwrites its value instead.
+         * remove_batch: remove one pair for every key of [first, last), @return number of pairs removed
+         */
+        template<typename InputIt>
+        void insert_batch(InputIt first, InputIt last, bool replace = false);
+
+        template<typename InputIt>
+        size_t remove_batch(InputIt first, InputIt last);
+
+        /*
+         * Cursor: lazy walk along the leaf chain.
+         * It keeps its leaf pinned and holds the tree shared until destroyed,
+         * so don't modify the tree from a thread that has a cursor open.
+         * Past the middle of its first leaf it starts reading ahead: the next leaves, taken from the children
+         * of the leaf's parent, are hinted to the backend, a window that doubles with every leaf the scan moves on.
+         */
+        class Cursor {
+            friend class BPTree;
+            BPTree* tree;
+            std::shared_lock<std::shared_mutex> guard;
+            NodePtr leaf;
+            size_t index;
+            // leaf is child slot of parent, pinned too. Children up to ahead in the direction of the scan are hinted
+            NodePtr parent;
+            size_t slot, ahead, window;
+            bool forward;
+
+            Cursor(BPTree* t, std::shared_lock<std::shared_mutex>&& g) : tree(t), guard(std::move(g)), leaf(nullptr), index(0),
+                                                                         parent(nullptr), slot(0), ahead(0), window(0), forward(true) {}
+
+            void step(bool forward);
+            void read_ahead(bool forward);
+            void settle_forward();
+            void settle_backward();
+        public:
+            Cursor(Cursor&& other) noexcept : tree(other.tree), guard(std::move(other.guard)), leaf(other.leaf), index(other.index),
+                                              parent(other.parent), slot(other.slot), ahead(other.ahead), window(other.window),
+                                              forward(other.forward) {
+                other.leaf = other.parent = nullptr;
+            }
+
+            Cursor(const Cursor&) = delete;
+
+            Cursor& operator=(const Cursor&) = delete;
+
+            ~Cursor() {
+                if (leaf)tree->releaseNode(leaf);
+                if (parent)tree->releaseNode(parent);
+            }
+
+            bool valid() const { return leaf; }
+            const KeyType& key() const { return leaf->K[index]; }
+            const ValueType& value() const { return leaf->V[index]; }
+            void next();
+            void prev();
+        };
+
+        /*
+         * cursor: positioned at the first key >= low
+         * reverse_cursor: positioned at the last key <= high, walk it with prev()
+         */
+        Cursor cursor(const KeyType& low);
+
+        Cursor reverse_cursor(const KeyType& high);
+
+        /*
+         * range: low <= key <= high
          */
         std::vector<std::pair<KeyType, ValueType>> range(KeyType low, KeyType high);
 
-        ~BPTree() = default;
+        /*
+         * bulk_load: build an empty tree bottom-up from [first, last), which must be sorted by WeakCmp,
+         * unsorted input throws logic_error and leaves the tree empty.
+         * Leaves are filled left to right up to fill_factor*LEAF_MAX_ENTRY, internal levels are built
+         * from the first keys of the level below. Every node is allocated once and never split.
+         */
+        template<typename InputIt>
+        void bulk_load(InputIt first, InputIt last, double fill_factor = 1.0);
+
+        /*
+         * compact: move the live nodes to the front of the file, internal nodes level by level, then the leaves
+         * in key order, and cut the file after them, so that scans along the leaf chain read it sequentially.
+         * It takes the tree exclusively for up to step node moves at a time, searches, cursors and writers
+         * run in between. A writer in between makes it scan the tree again, the blocks placed so far stay as they are.
+         * progress(placed, total) is called after each step,
+         * returning false stops early with the nodes placed so far. Blocks freed while it runs are reused
+         * once it returns. @return blocks cut off the file
+         */
+        size_t compact(const std::function<bool(size_t, size_t)>& progress = nullptr, size_t step = 256);
+
+        /*
+         * Snapshot: a read-only view of the tree as it was when snapshot() returned.
+         * Unlike a Cursor it holds no latch between calls, so writers go on while it is open:
+         * the first change of a node after a snapshot keeps a copy of the node as it was,
+         * dropped once every snapshot older than the change is closed. Nodes read through it are copied.
+         * The copies live in memory, at most set_version_limit() of them: a write that would keep more expires
+         * the oldest snapshots and drops the copies only they needed, and any later read through an expired
+         * snapshot throws runtime_error. Close snapshots before the tree is destroyed.
+         */
+        class Snapshot {
+            friend class BPTree;
+            BPTree* tree;
+            uint64_t at;
+            DiskLoc_T root;
+
+            Snapshot(BPTree* t, uint64_t v, DiskLoc_T r) : tree(t), at(v), root(r) {}
+
+            // the node key belongs to on the level of out, starting from the root
+            void descend(const KeyType& key, bool lower, NodeT* out) const;
+        public:
+            Snapshot(Snapshot&& other) noexcept : tree(other.tree), at(other.at), root(other.root) { other.tree = nullptr; }
+
+            Snapshot(const Snapshot&) = delete;
+
+            Snapshot& operator=(const Snapshot&) = delete;
+
+            ~Snapshot() {
+                if (tree)tree->close_snapshot(at);
+            }
+
+            class Cursor {
+                friend class Snapshot;
+                const Snapshot* snapshot;
+                std::unique_ptr<NodeT> leaf;
+                size_t index;
+
+                explicit Cursor(const Snapshot* s) : snapshot(s), leaf(new NodeT), index(0) {}
+
+                void settle();
+            public:
+                bool valid() const { return leaf != nullptr; }
+                const KeyType& key() const { return leaf->K[index]; }
+                const ValueType& value() const { return leaf->V[index]; }
+                void next();
+            };
+
+            std::pair<ValueType, bool> search(const KeyType& key) const;
+
+            // positioned at the first key >= low
+            Cursor cursor(const KeyType& low) const;
+
+            // low <= key <= high
+            std::vector<std::pair<KeyType, ValueType>> range(const KeyType& low, const KeyType& high) const;
+
+            /*
+             * split: up to parts-1 ascending keys in (low, high] that cut [low, high] into parts of about the same
+             * number of leaves, taken from the separators of the highest level of internal nodes that has enough
+             * of them within the range. Only the nodes overlapping the range are read, down to the first leaf at most.
+             */
+            std::vector<KeyType> split(const KeyType& low, const KeyType& high, size_t parts) const;
+
+            /*
+             * parallel_range: low <= key <= high, cut by split() and each part scanned on a thread of its own,
+             * the first on the calling thread. fn(part, key, value) gets the pairs of a part in key order,
+             * parts run concurrently and are numbered in key order. The first exception thrown by fn stops
+             * the other parts and is rethrown once all threads are joined. @return the number of parts
+             * The second form collects the pairs of each part and returns them concatenated, in key order.
+             */
+            size_t parallel_range(const KeyType& low, const KeyType& high, size_t parts,
+                                  const std::function<void(size_t, const KeyType&, const ValueType&)>& fn) const;
+
+            std::vector<std::pair<KeyType, ValueType>> parallel_range(const KeyType& low, const KeyType& high, size_t parts) const;
+        };
+
+        Snapshot snapshot();
+
+        /*
+         * parallel_range: Snapshot::parallel_range on a snapshot taken for the call, so the scan sees the tree
+         * as of the call and writers go on meanwhile. parts defaults to the number of hardware threads.
+         */
+        size_t parallel_range(const KeyType& low, const KeyType& high,
+                              const std::function<void(size_t, const KeyType&, const ValueType&)>& fn, size_t parts = 0) {
+            return snapshot().parallel_range(low, high, parts ? parts : hardware_parts(), fn);
+        }
+
+        std::vector<std::pair<KeyType, ValueType>> parallel_range(const KeyType& low, const KeyType& high, size_t parts = 0) {
+            return snapshot().parallel_range(low, high, parts ? parts : hardware_parts());
+        }
+
+        /*
+         * stats: the counters of the tree and its backend summed over all threads, the latency histograms
+         * when they are on, and the height and leaf fill factor of the tree. The counters are read without a lock.
+         * The first call on an opened tree counts its leaves, later ones only walk down the left edge.
+         * reset_stats: start the counters and histograms over
+         * set_latency_stats: time search, insert, remove, range and batch calls, off by default
+         */
+        analysis::Snapshot stats();
+
+        void reset_stats() { counters.reset(); }
+
+        void set_latency_stats(bool on) { counters.set_latency(on); }
+
+#ifdef BPTREE_ORDER_STATS
+        /*
+         * Order statistics: internal nodes count the pairs under each child, so these take one descent from the root.
+         * rank: the number of pairs with a key below key
+         * count: the number of pairs with low <= key <= high
+         * select: a cursor at the i-th pair in key order, counting from 0, not valid when i is past the end
+         */
+        uint64_t rank(const KeyType& key) {
+            std::shared_lock<std::shared_mutex> guard(latch);
+            return rank_of(key, false);
+        }
+
+        uint64_t count(const KeyType& low, const KeyType& high) {
+            std::shared_lock<std::shared_mutex> guard(latch);
+            if (les(high, low))return 0;
+            return rank_of(high, true)-rank_of(low, false);
+        }
+
+        Cursor select(uint64_t i);
+#endif
+
+        ~BPTree() { drop_top(); }
     };
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    int BPTree<KeyType, ValueType, WeakCmp>::basic_search(const KeyType& key) {
-        NodePtr cur = loadNode(root);
-        path_stack[0] = cur;
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    int BPTree<KeyType, ValueType, WeakCmp, Degree>::basic_search(Path& path, const KeyType& key) {
+        // a reader doesn't need the nodes above, it may start below the top index and path.nodes[0] isn't the root then
+        NodePtr cur = load(path, path.writer ? root : top_target(key, false));
+        path.nodes[0] = cur;
         int counter = 0;
-        while (cur->type == Node<KeyType, ValueType>::INTERNAL) {
-            int off = (key < cur->K[0]) ? 0:(int) (upper_bound(cur->K, cur->K+cur->size, key)-cur->K) ;
-            cur = loadNode(cur->sub_nodes[off]);
-            path_stack[++counter] = cur;
-            in_node_offset_stack[counter] = off;
+        while (cur->type == Node<KeyType, ValueType, Degree>::INTERNAL) {
+            int off = (int) Search::upper(cur->K, cur->size, key, les);
+            cur = load(path, cur, off);
+            path.nodes[++counter] = cur;
+            path.offsets[counter] = off;
         }
         return counter;
     }
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    std::pair<ValueType, bool> BPTree<KeyType, ValueType, WeakCmp>::search(const KeyType& key) {
-        if (root == Node<KeyType, ValueType>::NONE)
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    DiskLoc_T BPTree<KeyType, ValueType, WeakCmp, Degree>::top_target(const KeyType& key, bool lower) {
+        if (!top_nodes)return root;
+        TopIndex* t = top.load(std::memory_order_acquire);
+        if (!t)t = build_top();
+        // the flattened separators sort like a descent through them: as many of them lie below key
+        return t->targets[lower ? t->separators.lower(key, les) : t->separators.upper(key, les)];
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    int BPTree<KeyType, ValueType, WeakCmp, Degree>::height() {
+        int height = 0;
+        for (NodePtr ptr = root == NodeT::NONE ? nullptr : loadNode(root); ptr; ++height) {
+            NodePtr next = ptr->type == NodeT::INTERNAL ? loadChild(ptr, 0) : nullptr;
+            releaseNode(ptr);
+            ptr = next;
+        }
+        return height;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    typename BPTree<KeyType, ValueType, WeakCmp, Degree>::TopIndex* BPTree<KeyType, ValueType, WeakCmp, Degree>::build_top() {
+        // readers hold the tree shared, so the nodes can't change under them, only another reader may build it first
+        std::lock_guard<std::mutex> guard(top_lock);
+        if (TopIndex* t = top.load(std::memory_order_acquire))return t;
+        // stop at the parents of leaves
+        int height = this->height();
+        std::vector<KeyType> separators, below;
+        std::vector<DiskLoc_T> targets{root}, children;
+        int depth = 0;
+        for (size_t covered = 0; depth+2 < height && covered+targets.size() <= top_nodes; ++depth) {
+            covered += targets.size();
+            below.clear();
+            children.clear();
+            for (size_t i = 0; i < targets.size(); ++i) {
+                if (i)below.push_back(separators[i-1]);
+                NodePtr node = loadNode(targets[i]);
+                below.insert(below.end(), node->K, node->K+node->size);
+                for (size_t j = 0; j <= node->size; ++j)children.push_back(child(node, j));
+                releaseNode(node);
+            }
+            separators.swap(below);
+            targets.swap(children);
+        }
+        auto t = new TopIndex{Eytzinger<KeyType, WeakCmp>(separators.data(), separators.size()), std::move(targets), depth};
+        top.store(t, std::memory_order_release);
+        return t;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    std::pair<ValueType, bool> BPTree<KeyType, ValueType, WeakCmp, Degree>::search(const KeyType& key) {
+        analysis::Timer timer(counters, analysis::OP_SEARCH);
+        std::shared_lock<std::shared_mutex> guard(latch);
+        if (root == Node<KeyType, ValueType, Degree>::NONE)
             return {ValueType(), false};
-        NodePtr cur = path_stack[basic_search(key)];
-        size_t i = lower_bound(cur->K, cur->K+cur->size, key)-cur->K;
-        if (i < cur->size && key == cur->K[i])
-            return {cur->V[i], true};
-        else return {ValueType(), false};
+        // find_leaf keeps two nodes pinned at a time, so many readers don't pin a small cache full
+        NodePtr cur = find_leaf(key, false);
+        size_t i = Search::lower(cur->K, cur->size, key, les);
+        std::pair<ValueType, bool> found(ValueType(), false);
+        if (i < cur->size && key == cur->K[i])found = {cur->V[i], true};
+        releaseNode(cur);
+        return found;
     }
 
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    size_t BPTree<KeyType, ValueType, WeakCmp>::insert_inplace(NodePtr& node, const KeyType& key, const ValueType& value) {
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    std::vector<std::pair<ValueType, bool>>
+    BPTree<KeyType, ValueType, WeakCmp, Degree>::multi_search(const KeyType* keys, size_t count) {
+        analysis::Timer timer(counters, analysis::OP_BATCH);
+        std::vector<std::pair<ValueType, bool>> result(count, {ValueType(), false});
+        std::shared_lock<std::shared_mutex> guard(latch);
+        if (root == Node<KeyType, ValueType, Degree>::NONE || !count)
+            return result;
+        std::vector<size_t> order(count);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return les(keys[a], keys[b]); });
+
+        // nodes[i] covers the keys below fence[i], a null fence is unbounded
+        struct Descent {
+            BPTree* tree;
+            NodePtr nodes[STACK_DEPTH];
+            const KeyType* fence[STACK_DEPTH];
+            int depth;
+
+            ~Descent() {
+                for (int i = 0; i <= depth; ++i)tree->releaseNode(nodes[i]);
+            }
+        } d{this, {}, {}, -1};
+        d.nodes[0] = loadNode(root);
+        d.fence[0] = nullptr;
+        d.depth = 0;
+
+        for (size_t n = 0; n < count; ++n) {
+            const KeyType& key = keys[order[n]];
+            // keys ascend, so only the upper fence can be crossed
+            while (d.depth && d.fence[d.depth] && !les(key, *d.fence[d.depth]))
+                releaseNode(d.nodes[d.depth--]);
+            NodePtr cur = d.nodes[d.depth];
+            bool descended = false;
+            while (cur->type == Node<KeyType, ValueType, Degree>::INTERNAL) {
+                size_t off = Search::upper(cur->K, cur->size, key, les);
+                const KeyType* fence = off < cur->size ? cur->K+off : d.fence[d.depth];
+                cur = loadChild(cur, off);
+                d.nodes[++d.depth] = cur;
+                d.fence[d.depth] = fence;
+                descended = true;
+            }
+            if (descended && d.depth && n+PREFETCH_AHEAD < count) {
+                // hint the leaf a later key of the batch lands in, if it shares the parent
+                NodePtr parent = d.nodes[d.depth-1];
+                const KeyType& ahead = keys[order[n+PREFETCH_AHEAD]];
+                if (!d.fence[d.depth-1] || les(ahead, *d.fence[d.depth-1])) {
+                    DiskLoc_T leaf = unswizzle(child(parent, Search::upper(parent->K, parent->size, ahead, les)));
+                    if (leaf != cur->offset)prefetchNode(leaf);
+                }
+            }
+            size_t i = Search::lower(cur->K, cur->size, key, les);
+            if (i < cur->size && key == cur->K[i])
+                result[order[n]] = {cur->V[i], true};
+        }
+        return result;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    size_t BPTree<KeyType, ValueType, WeakCmp, Degree>::insert_inplace(NodePtr& node, const KeyType& key, const ValueType& value) {
         size_t i;
         if (!node->size) {
             node->K[0] = key;
@@ -188,7 +980,7 @@ namespace bptree {
             i = 0;
         } else {
             auto& keys = node->K;
-            i = upper_bound(keys, keys+node->size, key)-keys;
+            i = Search::upper(keys, node->size, key, les);
             move_backward(keys+i, keys+node->size, keys+node->size+1);
             move_backward(node->V+i, node->V+node->size, node->V+node->size+1);
             node->K[i] = key;
@@ -199,8 +991,8 @@ namespace bptree {
         return i;
     }
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    size_t BPTree<KeyType, ValueType, WeakCmp>::insert_key_inplace(NodePtr& node, const KeyType& key, DiskLoc_T offset) {
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    size_t BPTree<KeyType, ValueType, WeakCmp, Degree>::insert_key_inplace(NodePtr& node, const KeyType& key, DiskLoc_T offset) {
         size_t i;
         if (!node->size) {
             node->K[0] = key;
@@ -208,9 +1000,11 @@ namespace bptree {
             i = 0;
         } else {
             auto& keys = node->K;
-            i = upper_bound(keys, keys+node->size, key)-keys;
+            i = Search::upper(keys, node->size, key, les);
             move_backward(keys+i, keys+node->size, keys+node->size+1);
             move_backward(node->sub_nodes+i+1, node->sub_nodes+node->size+1, node->sub_nodes+node->size+2);
+            if constexpr (ORDER_STATS)
+                move_backward(node->counts+i+1, node->counts+node->size+1, node->counts+node->size+2);
             node->K[i] = key;
             node->sub_nodes[i+1] = offset;
         }
@@ -219,91 +1013,257 @@ namespace bptree {
         return i;
     }
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    std::tuple<KeyType, DiskLoc_T>
-    BPTree<KeyType, ValueType, WeakCmp>::insert_key(NodePtr& cur, const KeyType& key, bptree::DiskLoc_T offset) {
-        // @return new allocated node
-        insert_key_inplace(cur, key, offset);
-        NodePtr new_node = initNode(Node<KeyType, ValueType>::INTERNAL);
-        cur->size = DEGREE-INTERNAL_MIN_ENTRY-1;
-        new_node->size = INTERNAL_MIN_ENTRY;
-        move(cur->K+(DEGREE-INTERNAL_MIN_ENTRY), cur->K+DEGREE, new_node->K);
-        move(cur->sub_nodes+(DEGREE-INTERNAL_MIN_ENTRY), cur->sub_nodes+DEGREE+1, new_node->sub_nodes);
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    std::tuple<KeyType, Node<KeyType, ValueType, Degree>*>
+    BPTree<KeyType, ValueType, WeakCmp, Degree>::split_keys(Path& path, NodePtr& cur) {
+        // @return the key moving up and the new right node
+        counters.add(analysis::SPLIT);
+        size_t at = split_at(cur->K, cur->size, false, DEGREE-INTERNAL_MIN_ENTRY-1);
+        NodePtr new_node = create(path, Node<KeyType, ValueType, Degree>::INTERNAL);
+        new_node->size = cur->size-at-1;
+        move(cur->K+at+1, cur->K+cur->size, new_node->K);
+        move(cur->sub_nodes+at+1, cur->sub_nodes+cur->size+1, new_node->sub_nodes);
+        if constexpr (ORDER_STATS) move(cur->counts+at+1, cur->counts+cur->size+1, new_node->counts);
+        cur->size = at;
         saveNode(cur);
         saveNode(new_node);
         // pass the deleted key back
-        return {cur->K[cur->size], new_node->offset};
+        return {cur->K[at], new_node};
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    size_t BPTree<KeyType, ValueType, WeakCmp, Degree>::byte_split(const KeyType* keys, size_t n, bool leaf) {
+        typedef key_traits<KeyType> Traits;
+        const size_t entry = leaf ? sizeof(ValueType) : CHILD_SIZE;
+        // front[i]: prefix shared by keys [0, i], back[i]: by keys [i, n), sum[i]: bytes of keys [0, i) uncompressed
+        std::vector<size_t> front(n), back(n+1, 0), sum(n+1, 0);
+        for (size_t i = 0; i < n; ++i) {
+            front[i] = i ? std::min(front[i-1], Traits::common_prefix(keys[0], keys[i])) : keys[0].size();
+            sum[i+1] = sum[i]+1+keys[i].size()+entry;
+        }
+        for (size_t i = n; i--;)
+            back[i] = i+1 < n ? std::min(back[i+1], Traits::common_prefix(keys[i], keys[n-1])) : keys[i].size();
+        // both halves pay the header, so compare what follows it
+        size_t first = 1, last = n-1;
+        if (!leaf) {
+            // key at moves up, keep one on each side when there are enough
+            first = n < 3 ? 0 : 1;
+            last = n < 3 ? n-1 : n-2;
+        }
+        size_t best = first, best_size = SIZE_MAX;
+        for (size_t at = first; at <= last; ++at) {
+            size_t from = leaf ? at : at+1;
+            size_t lp = at ? front[at-1] : 0, rp = from < n ? back[from] : 0;
+            size_t left = lp+sum[at]-at*lp, right = rp+sum[n]-sum[from]-(n-from)*rp;
+            if (std::max(left, right) < best_size) {
+                best_size = std::max(left, right);
+                best = at;
+            }
+        }
+        return best;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    size_t BPTree<KeyType, ValueType, WeakCmp, Degree>::byte_group(NodePtr leaf, const std::vector<std::pair<KeyType, ValueType>>& batch,
+                                                                   size_t i, size_t end) {
+        // the group stops where a single split might leave a half over its block
+        const size_t bound = 2*NodeT::BLOCK_SIZE-NODE_HEADER_SIZE-1-key_traits<KeyType>::MAX_BYTES-NodeT::MAX_ENTRY_SIZE;
+        Encoding e(true);
+        for (size_t k = 0; k < leaf->size; ++k)e.add(leaf->K[k]);
+        size_t j = i;
+        for (; j < end; ++j) {
+            if (j > i && Encoding(e).add(batch[j].first).size() > bound)break;
+            e.add(batch[j].first);
+        }
+        return j;
     }
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    void BPTree<KeyType, ValueType, WeakCmp>::insert(const KeyType& key, const ValueType& value) {
-        if (root == Node<KeyType, ValueType>::NONE) {
-            NodePtr ptr = initNode(Node<KeyType, ValueType>::LEAF);
-            ptr->prev = ptr->next = Node<KeyType, ValueType>::NONE;
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::insert(const KeyType& key, const ValueType& value) {
+        analysis::Timer timer(counters, analysis::OP_INSERT);
+        OpSync op_sync(this);
+        std::unique_lock<std::shared_mutex> guard(latch);
+        Path path(this, true);
+        ++pair_count;
+        if (root == Node<KeyType, ValueType, Degree>::NONE) {
+            NodePtr ptr = create(path, Node<KeyType, ValueType, Degree>::LEAF);
+            ptr->prev = ptr->next = Node<KeyType, ValueType, Degree>::NONE;
             insert_inplace(ptr, key, value);
             saveNode(ptr);
             root = ptr->offset;
+            drop_top();
             return;
         }
-        int cur_index = basic_search(key);
-        if (path_stack[cur_index]->size < LEAF_MAX_ENTRY) {
-            insert_inplace(path_stack[cur_index], key, value);
-            return;
-        }
+        int cur_index = basic_search(path, key);
+        NodePtr& cur = path.nodes[cur_index];
+        insert_inplace(cur, key, value);
+        add_count(path, cur_index, 1);
+        if (!overfull(cur))return;
 
         // split leaf node
-        insert_inplace(path_stack[cur_index], key, value);
-        NodePtr new_node = initNode(Node<KeyType, ValueType>::LEAF);
-        NodePtr& cur = path_stack[cur_index];
-        // move and insert
-        move(cur->K+DEGREE+1-LEAF_MIN_ENTRY, cur->K+DEGREE+1, new_node->K);
-        move(cur->V+DEGREE+1-LEAF_MIN_ENTRY, cur->V+DEGREE+1, new_node->V);
-        new_node->size = LEAF_MIN_ENTRY;
-        cur->size = DEGREE+1-LEAF_MIN_ENTRY;
+        NodePtr new_node = create(path, Node<KeyType, ValueType, Degree>::LEAF);
+        size_t left = split_at(cur->K, cur->size, true, cur->size-LEAF_MIN_ENTRY);
+        move(cur->K+left, cur->K+cur->size, new_node->K);
+        move(cur->V+left, cur->V+cur->size, new_node->V);
+        new_node->size = cur->size-left;
+        cur->size = left;
+        link_leaf(path, cur, new_node);
+        insert_into_parents(path, cur_index-1, key_traits<KeyType>::separator(cur->K[left-1], new_node->K[0]), new_node);
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::link_leaf(Path& path, NodePtr cur, NodePtr new_node) {
+        // new_node goes right after cur in the leaf chain, link_leaf only follows a split
+        counters.add(analysis::SPLIT);
         new_node->prev = cur->offset;
-        if (cur->next != Node<KeyType, ValueType>::NONE) {
-            NodePtr c_next = loadNode(cur->next);
-            new_node->next = c_next->offset;
+        new_node->next = cur->next;
+        if (cur->next != Node<KeyType, ValueType, Degree>::NONE) {
+            NodePtr c_next = load(path, cur->next);
             c_next->prev = new_node->offset;
             saveNode(c_next);
         }
         cur->next = new_node->offset;
         saveNode(new_node);
         saveNode(cur);
+    }
 
-        // update parents
-        --cur_index;
-        KeyType key_update_ready = new_node->K[0];
-        DiskLoc_T processing_offset = new_node->offset;
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::insert_into_parents(Path& path, int cur_index,
+                                                                          KeyType key_update_ready, NodePtr sibling) {
+        // add the split off node right of path.nodes[cur_index+1], splitting parents as needed
         bool set_root = true;
         for (; cur_index >= 0; --cur_index) {
-            if (path_stack[cur_index]->size < INTERNAL_MAX_ENTRY) {
-                insert_key_inplace(path_stack[cur_index], key_update_ready, processing_offset);
+            top_changed(cur_index);
+            size_t at = insert_key_inplace(path.nodes[cur_index], key_update_ready, sibling->offset);
+            set_count(path.nodes[cur_index], path.offsets[cur_index+1], path.nodes[cur_index+1]);
+            set_count(path.nodes[cur_index], at+1, sibling);
+            if (!overfull(path.nodes[cur_index])) {
                 set_root = false;
                 break;
-            } else {
-                tie(key_update_ready, processing_offset) = insert_key(path_stack[cur_index], key_update_ready,
-                                                                      processing_offset);
             }
+            tie(key_update_ready, sibling) = split_keys(path, path.nodes[cur_index]);
         }
         if (set_root) {
-            NodePtr new_root = initNode(Node<KeyType, ValueType>::INTERNAL);
+            NodePtr new_root = create(path, Node<KeyType, ValueType, Degree>::INTERNAL);
             new_root->size = 1;
             new_root->K[0] = key_update_ready;
-            new_root->sub_nodes[0] = path_stack[0]->offset;
-            new_root->sub_nodes[1] = processing_offset;
+            new_root->sub_nodes[0] = path.nodes[0]->offset;
+            new_root->sub_nodes[1] = sibling->offset;
+            set_count(new_root, 0, path.nodes[0]);
+            set_count(new_root, 1, sibling);
             saveNode(new_root);
             root = new_root->offset;
+            drop_top();
+        }
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    template<typename InputIt>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::insert_batch(InputIt first, InputIt last, bool replace) {
+        analysis::Timer timer(counters, analysis::OP_BATCH);
+        std::vector<std::pair<KeyType, ValueType>> batch(first, last);
+        std::stable_sort(batch.begin(), batch.end(), [this](const std::pair<KeyType, ValueType>& a,
+                                                            const std::pair<KeyType, ValueType>& b) {
+            return les(a.first, b.first);
+        });
+        if (replace) {
+            // the last of equal keys wins
+            auto out = batch.begin();
+            for (auto it = batch.begin(); it != batch.end(); ++it)
+                if (it+1 == batch.end() || les(it->first, (it+1)->first))*out++ = *it;
+            batch.erase(out, batch.end());
+        }
+        OpSync op_sync(this);
+        std::unique_lock<std::shared_mutex> guard(latch);
+        std::vector<size_t> fresh;
+        std::vector<KeyType> keys;
+        std::vector<ValueType> values;
+        for (size_t i = 0; i < batch.size();) {
+            Path path(this, true);
+            if (root == Node<KeyType, ValueType, Degree>::NONE) {
+                NodePtr ptr = create(path, Node<KeyType, ValueType, Degree>::LEAF);
+                ptr->prev = ptr->next = Node<KeyType, ValueType, Degree>::NONE;
+                saveNode(ptr);
+                root = ptr->offset;
+                drop_top();
+            }
+            int cur_index = basic_search(path, batch[i].first);
+            NodePtr cur = path.nodes[cur_index];
+            // the group is what belongs to this leaf, bounded so that it splits at most once
+            const KeyType* fence = leaf_fence(path, cur_index);
+            size_t end = i, limit = std::min(batch.size(), i+2*LEAF_MAX_ENTRY-cur->size);
+            while (end < limit && (!fence || les(batch[end].first, *fence)))++end;
+            if constexpr (VARIABLE) end = byte_group(cur, batch, i, end);
+
+            fresh.clear();
+            for (; i < end; ++i) {
+                if (replace) {
+                    size_t at = Search::lower(cur->K, cur->size, batch[i].first, les);
+                    if (at < cur->size && !les(batch[i].first, cur->K[at])) {
+                        cur->V[at] = batch[i].second;
+                        continue;
+                    }
+                }
+                fresh.push_back(i);
+            }
+            size_t total = cur->size+fresh.size();
+            pair_count += fresh.size();
+            add_count(path, cur_index, (int64_t) fresh.size());
+            keys.clear();
+            values.clear();
+            if (total <= LEAF_MAX_ENTRY) {
+                // merge from the back, existing pairs stay in front of equal keys like with insert
+                size_t j = cur->size, w = total;
+                for (size_t f = fresh.size(); f--;) {
+                    const KeyType& key = batch[fresh[f]].first;
+                    for (; j && les(key, cur->K[j-1]); --j) {
+                        cur->K[--w] = cur->K[j-1];
+                        cur->V[w] = cur->V[j-1];
+                    }
+                    cur->K[--w] = key;
+                    cur->V[w] = batch[fresh[f]].second;
+                }
+                cur->size = total;
+                saveNode(cur);
+                if (!overfull(cur))continue;
+                // variable length keys outgrew the block
+                keys.assign(cur->K, cur->K+total);
+                values.assign(cur->V, cur->V+total);
+            } else {
+                // overflow: merge aside and split once
+                size_t j = 0;
+                for (size_t f : fresh) {
+                    const KeyType& key = batch[f].first;
+                    for (; j < cur->size && !les(key, cur->K[j]); ++j) {
+                        keys.push_back(cur->K[j]);
+                        values.push_back(cur->V[j]);
+                    }
+                    keys.push_back(key);
+                    values.push_back(batch[f].second);
+                }
+                keys.insert(keys.end(), cur->K+j, cur->K+cur->size);
+                values.insert(values.end(), cur->V+j, cur->V+cur->size);
+            }
+            size_t left = split_at(keys.data(), total, true, total-total/2);
+            move(keys.begin(), keys.begin()+left, cur->K);
+            move(values.begin(), values.begin()+left, cur->V);
+            cur->size = left;
+            NodePtr new_node = create(path, Node<KeyType, ValueType, Degree>::LEAF);
+            move(keys.begin()+left, keys.end(), new_node->K);
+            move(values.begin()+left, values.end(), new_node->V);
+            new_node->size = total-left;
+            link_leaf(path, cur, new_node);
+            insert_into_parents(path, cur_index-1, key_traits<KeyType>::separator(keys[left-1], keys[left]), new_node);
         }
     }
 
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    bool BPTree<KeyType, ValueType, WeakCmp>::remove_inplace(NodePtr& node, const KeyType& key) {
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    bool BPTree<KeyType, ValueType, WeakCmp, Degree>::remove_inplace(NodePtr& node, const KeyType& key) {
         auto& vs = node->V;
         auto& ks = node->K;
-        size_t i = std::lower_bound(ks, ks+node->size, key)-ks;
-        if (ks[i] != key)
+        size_t i = Search::lower(ks, node->size, key, les);
+        if (i == node->size || ks[i] != key)
             return false;
         move(vs+i+1, vs+node->size, vs+i);
         move(ks+i+1, ks+node->size, ks+i);
@@ -312,73 +1272,101 @@ namespace bptree {
         return true;
     }
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    void BPTree<KeyType, ValueType, WeakCmp>::remove_offset_inplace(NodePtr& node, KeyType key, DiskLoc_T offset) {
-        auto key_iter = std::lower_bound(node->K, node->K+node->size, key);
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::remove_offset_inplace(NodePtr& node, KeyType key, DiskLoc_T offset) {
+        auto key_iter = node->K+Search::lower(node->K, node->size, key, les);
         move(key_iter+1, node->K+node->size, key_iter);
 
         auto off_iter = &node->sub_nodes[key_iter-node->K];
-        if (*off_iter != offset)off_iter++;
+        if (unswizzle(*off_iter) != offset)off_iter++;
+        if constexpr (ORDER_STATS) {
+            // the child on the other side of the key is the one it was merged into
+            size_t gone = off_iter-node->sub_nodes, into = gone == (size_t) (key_iter-node->K) ? gone+1 : gone-1;
+            node->counts[into] += node->counts[gone];
+            move(node->counts+gone+1, node->counts+node->size+1, node->counts+gone);
+        }
         move(off_iter+1, node->sub_nodes+node->size+1, off_iter);
         --node->size;
         saveNode(node);
     }
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    bool BPTree<KeyType, ValueType, WeakCmp>::borrow_value(int index) {
-        NodePtr nearby = getLeft(index), node = path_stack[index];
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    bool BPTree<KeyType, ValueType, WeakCmp, Degree>::borrow_value(Path& path, int index) {
+        // a borrowed key may not fit, and the new separator may not fit the parent
+        if (VARIABLE)return false;
+        NodePtr nearby = getLeft(path, index), node = path.nodes[index];
+        int direction = LEFT;
         if (nearby && nearby->size > LEAF_MIN_ENTRY) {
             // Left
             move_backward(node->K, node->K+node->size, node->K+node->size+1);
             move_backward(node->V, node->V+node->size, node->V+node->size+1);
-            find_mid_key(index, LEFT) = node->K[0] = nearby->K[nearby->size-1];
+            top_changed(index-1);
+            find_mid_key(path, index, LEFT) = node->K[0] = nearby->K[nearby->size-1];
             node->V[0] = nearby->V[nearby->size-1];
-            saveNode(path_stack[index-1]);
-        } else if ((nearby = getRight(index)) && nearby->size > LEAF_MIN_ENTRY) {
+            saveNode(path.nodes[index-1]);
+        } else if ((nearby = getRight(path, index)) && nearby->size > LEAF_MIN_ENTRY) {
             // RIGHT
+            direction = RIGHT;
             node->K[node->size] = nearby->K[0];
             node->V[node->size] = nearby->V[0];
             move(nearby->K+1, nearby->K+nearby->size, nearby->K);
             move(nearby->V+1, nearby->V+nearby->size, nearby->V);
-            find_mid_key(index, RIGHT) = nearby->K[0];
-            saveNode(path_stack[index-1]);
+            top_changed(index-1);
+            find_mid_key(path, index, RIGHT) = nearby->K[0];
+            saveNode(path.nodes[index-1]);
         } else return false;
+        counters.add(analysis::BORROW);
         --nearby->size;
         ++node->size;
+        recount_borrow(path, index, nearby, direction);
         saveNode(node);
         saveNode(nearby);
         return true;
     }
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    bool BPTree<KeyType, ValueType, WeakCmp>::borrow_key(int index) {
-        NodePtr nearby = getLeft(index), node = path_stack[index];
-        if (nearby && nearby->size > LEAF_MIN_ENTRY) {
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    bool BPTree<KeyType, ValueType, WeakCmp, Degree>::borrow_key(Path& path, int index) {
+        if (VARIABLE)return false;
+        NodePtr nearby = getLeft(path, index), node = path.nodes[index];
+        int direction = LEFT;
+        top_changed(index-1);
+        if (nearby && nearby->size > INTERNAL_MIN_ENTRY) {
             // Left
             move_backward(node->K, node->K+node->size, node->K+node->size+1);
             move_backward(node->sub_nodes, node->sub_nodes+node->size+1, node->sub_nodes+node->size+2);
-            node->K[0] = find_mid_key(index, LEFT);
+            node->K[0] = find_mid_key(path, index, LEFT);
             node->sub_nodes[0] = nearby->sub_nodes[nearby->size];
-            find_mid_key(index, LEFT) = nearby->K[nearby->size-1];
-            saveNode(path_stack[index-1]);
-        } else if ((nearby = getRight(index)) && nearby->size > LEAF_MIN_ENTRY) {
+            if constexpr (ORDER_STATS) {
+                move_backward(node->counts, node->counts+node->size+1, node->counts+node->size+2);
+                node->counts[0] = nearby->counts[nearby->size];
+            }
+            find_mid_key(path, index, LEFT) = nearby->K[nearby->size-1];
+            saveNode(path.nodes[index-1]);
+        } else if ((nearby = getRight(path, index)) && nearby->size > INTERNAL_MIN_ENTRY) {
             // RIGHT
-            node->K[node->size] = find_mid_key(index, RIGHT);
+            direction = RIGHT;
+            node->K[node->size] = find_mid_key(path, index, RIGHT);
             node->sub_nodes[node->size+1] = nearby->sub_nodes[0];
-            find_mid_key(index, RIGHT) = nearby->K[0];
+            find_mid_key(path, index, RIGHT) = nearby->K[0];
             move(nearby->K+1, nearby->K+nearby->size, nearby->K);
             move(nearby->sub_nodes+1, nearby->sub_nodes+nearby->size+1, nearby->sub_nodes);
-            saveNode(path_stack[index-1]);
+            if constexpr (ORDER_STATS) {
+                node->counts[node->size+1] = nearby->counts[0];
+                move(nearby->counts+1, nearby->counts+nearby->size+1, nearby->counts);
+            }
+            saveNode(path.nodes[index-1]);
         } else return false;
+        counters.add(analysis::BORROW);
         --nearby->size;
         ++node->size;
+        recount_borrow(path, index, nearby, direction);
         saveNode(node);
         saveNode(nearby);
         return true;
     }
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    DiskLoc_T BPTree<KeyType, ValueType, WeakCmp>::merge_values(NodePtr& target, NodePtr& tobe, int direction) {
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    DiskLoc_T BPTree<KeyType, ValueType, WeakCmp, Degree>::merge_values(Path& path, NodePtr& target, NodePtr& tobe, int direction) {
         if (RIGHT == direction) {
             // tobe is left to target
             move_backward(target->K, target->K+target->size, target->K+target->size+tobe->size);
@@ -386,8 +1374,8 @@ namespace bptree {
             move(tobe->K, tobe->K+tobe->size, target->K);
             move(tobe->V, tobe->V+tobe->size, target->V);
             target->prev = tobe->prev;
-            if (tobe->prev != Node<KeyType, ValueType>::NONE) {
-                NodePtr tobe_prev = loadNode(tobe->prev);
+            if (tobe->prev != Node<KeyType, ValueType, Degree>::NONE) {
+                NodePtr tobe_prev = load(path, tobe->prev);
                 tobe_prev->next = target->offset;
                 saveNode(tobe_prev);
             }
@@ -396,21 +1384,22 @@ namespace bptree {
             move(tobe->K, tobe->K+tobe->size, target->K+target->size);
             move(tobe->V, tobe->V+tobe->size, target->V+target->size);
             target->next = tobe->next;
-            if (tobe->next != Node<KeyType, ValueType>::NONE) {
-                NodePtr tobe_next = loadNode(tobe->next);
+            if (tobe->next != Node<KeyType, ValueType, Degree>::NONE) {
+                NodePtr tobe_next = load(path, tobe->next);
                 tobe_next->prev = target->offset;
                 saveNode(tobe_next);
             }
         }
+        counters.add(analysis::MERGE);
         target->size += tobe->size;
         DiskLoc_T ret = tobe->offset;
-        deleteNode(tobe);
+        discard(path, tobe);
         saveNode(target);
         return ret;
     }
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    DiskLoc_T BPTree<KeyType, ValueType, WeakCmp>::merge_keys(KeyType mid_key, NodePtr& target, NodePtr& tobe, int direction) {
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    DiskLoc_T BPTree<KeyType, ValueType, WeakCmp, Degree>::merge_keys(Path& path, KeyType mid_key, NodePtr& target, NodePtr& tobe, int direction) {
         if (RIGHT == direction) {
             move_backward(target->K, target->K+target->size, target->K+target->size+tobe->size+1);
             move_backward(target->sub_nodes, target->sub_nodes+target->size+1,
@@ -418,133 +1407,983 @@ namespace bptree {
             target->K[tobe->size] = mid_key;
             move(tobe->K, tobe->K+tobe->size, target->K);
             move(tobe->sub_nodes, tobe->sub_nodes+tobe->size+1, target->sub_nodes);
+            if constexpr (ORDER_STATS) {
+                move_backward(target->counts, target->counts+target->size+1, target->counts+target->size+tobe->size+2);
+                move(tobe->counts, tobe->counts+tobe->size+1, target->counts);
+            }
         } else {
             target->K[target->size] = mid_key;
             move(tobe->K, tobe->K+tobe->size, target->K+target->size+1);
             move(tobe->sub_nodes, tobe->sub_nodes+tobe->size+1, target->sub_nodes+target->size+1);
+            if constexpr (ORDER_STATS) move(tobe->counts, tobe->counts+tobe->size+1, target->counts+target->size+1);
         }
+        counters.add(analysis::MERGE);
         target->size += tobe->size+1;
         DiskLoc_T ret = tobe->offset;
-        deleteNode(tobe);
+        discard(path, tobe);
         saveNode(target);
         return ret;
     }
 
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    bool BPTree<KeyType, ValueType, WeakCmp>::remove(const KeyType& key) {
-        if (root == Node<KeyType, ValueType>::NONE)
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    bool BPTree<KeyType, ValueType, WeakCmp, Degree>::remove(const KeyType& key) {
+        analysis::Timer timer(counters, analysis::OP_REMOVE);
+        OpSync op_sync(this);
+        std::unique_lock<std::shared_mutex> guard(latch);
+        if (root == Node<KeyType, ValueType, Degree>::NONE)
             return false;
-        int cur_index = basic_search(key);
-        if (!remove_inplace(path_stack[cur_index], key))return false;
-        if (path_stack[cur_index]->size >= LEAF_MIN_ENTRY)return true;
-        if (path_stack[0]->type == Node<KeyType, ValueType>::LEAF) {
+        Path path(this, true);
+        int cur_index = basic_search(path, key);
+        if (!remove_inplace(path.nodes[cur_index], key))return false;
+        --pair_count;
+        add_count(path, cur_index, -1);
+        if (!underfull(path.nodes[cur_index]))return true;
+        rebalance_leaf(path, cur_index);
+        return true;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::rebalance_leaf(Path& path, int cur_index) {
+        // path.nodes[cur_index] is an underfull leaf, one entry short of LEAF_MIN_ENTRY for fixed size keys, or the root leaf
+        if (path.nodes[0]->type == Node<KeyType, ValueType, Degree>::LEAF) {
             // root case
-            if (!path_stack[0]->size) {
-                deleteNode(path_stack[0]);
-                root = Node<KeyType, ValueType>::NONE;
+            if (!path.nodes[0]->size) {
+                discard(path, path.nodes[0]);
+                root = Node<KeyType, ValueType, Degree>::NONE;
+                drop_top();
             }
-            return true;
+            return;
         }
         NodePtr neighbor;
         // update these
         DiskLoc_T updating_offset;
         KeyType updating_key;
-        if (borrow_value(cur_index)) {
-            return true;
-        } else if ((neighbor = getLeft(cur_index))) {
-            updating_offset = merge_values(neighbor, path_stack[cur_index], LEFT);
-            updating_key = find_mid_key(cur_index, LEFT);
-        } else {
-            neighbor = getRight(cur_index);
-            updating_offset = merge_values(neighbor, path_stack[cur_index], RIGHT);
-            updating_key = find_mid_key(cur_index, RIGHT);
-        }
+        // variable length keys stay underfull when neither merge fits
+        if (borrow_value(path, cur_index)) {
+            return;
+        } else if ((neighbor = getLeft(path, cur_index)) && mergeable(neighbor, path.nodes[cur_index])) {
+            updating_offset = merge_values(path, neighbor, path.nodes[cur_index], LEFT);
+            updating_key = find_mid_key(path, cur_index, LEFT);
+        } else if ((neighbor = getRight(path, cur_index)) && mergeable(path.nodes[cur_index], neighbor)) {
+            updating_offset = merge_values(path, neighbor, path.nodes[cur_index], RIGHT);
+            updating_key = find_mid_key(path, cur_index, RIGHT);
+        } else return;
         for (--cur_index; cur_index; --cur_index) {
-            remove_offset_inplace(path_stack[cur_index], updating_key, updating_offset);
-            if (path_stack[cur_index]->size >= INTERNAL_MIN_ENTRY)return true;
-            if (borrow_key(cur_index)) {
-                return true;
-            } else if ((neighbor = getLeft(cur_index))) {
-                updating_key = find_mid_key(cur_index, LEFT);
-                updating_offset = merge_keys(updating_key, neighbor, path_stack[cur_index], LEFT);
-            } else {
-                neighbor = getRight(cur_index);
-                updating_key = find_mid_key(cur_index, RIGHT);
-                updating_offset = merge_keys(updating_key, neighbor, path_stack[cur_index], RIGHT);
-            }
+            top_changed(cur_index);
+            remove_offset_inplace(path.nodes[cur_index], updating_key, updating_offset);
+            if (!underfull(path.nodes[cur_index]))return;
+            if (borrow_key(path, cur_index)) {
+                return;
+            } else if ((neighbor = getLeft(path, cur_index))
+                       && mergeable(neighbor, path.nodes[cur_index], &find_mid_key(path, cur_index, LEFT))) {
+                updating_key = find_mid_key(path, cur_index, LEFT);
+                updating_offset = merge_keys(path, updating_key, neighbor, path.nodes[cur_index], LEFT);
+            } else if ((neighbor = getRight(path, cur_index))
+                       && mergeable(path.nodes[cur_index], neighbor, &find_mid_key(path, cur_index, RIGHT))) {
+                updating_key = find_mid_key(path, cur_index, RIGHT);
+                updating_offset = merge_keys(path, updating_key, neighbor, path.nodes[cur_index], RIGHT);
+            } else return;
         }
-        remove_offset_inplace(path_stack[0], updating_key, updating_offset);
-        if (!path_stack[0]->size) {
-            NodePtr tmp = loadNode(path_stack[0]->sub_nodes[0]);
-            deleteNode(path_stack[0]);
+        top_changed(0);
+        remove_offset_inplace(path.nodes[0], updating_key, updating_offset);
+        if (!path.nodes[0]->size) {
+            NodePtr tmp = load(path, path.nodes[0], 0);
+            discard(path, path.nodes[0]);
             root = tmp->offset;
+            drop_top();
         }
-        return true;
     }
 
-    template<typename KeyType, typename ValueType, typename WeakCmp>
-    std::vector<std::pair<KeyType, ValueType>> BPTree<KeyType, ValueType, WeakCmp>::range(KeyType low, KeyType high) {
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    template<typename InputIt>
+    size_t BPTree<KeyType, ValueType, WeakCmp, Degree>::remove_batch(InputIt first, InputIt last) {
+        analysis::Timer timer(counters, analysis::OP_BATCH);
+        std::vector<KeyType> batch(first, last);
+        std::sort(batch.begin(), batch.end(), les);
+        OpSync op_sync(this);
+        std::unique_lock<std::shared_mutex> guard(latch);
+        size_t removed = 0;
+        for (size_t i = 0; i < batch.size() && root != Node<KeyType, ValueType, Degree>::NONE;) {
+            Path path(this, true);
+            int cur_index = basic_search(path, batch[i]);
+            NodePtr cur = path.nodes[cur_index];
+            const KeyType* fence = leaf_fence(path, cur_index);
+            // a leaf may drop one below the minimum, rebalance_leaf takes it from there.
+            // Leaves of variable length keys may empty, an empty leaf always merges
+            size_t floor = cur_index && !VARIABLE ? LEAF_MIN_ENTRY-1 : 0, j = 0, out = 0;
+            for (; i < batch.size() && (!fence || les(batch[i], *fence)) && cur->size-(j-out) > floor; ++i) {
+                for (; j < cur->size && les(cur->K[j], batch[i]); ++j, ++out) {
+                    cur->K[out] = cur->K[j];
+                    cur->V[out] = cur->V[j];
+                }
+                if (j < cur->size && !les(batch[i], cur->K[j]))++j;
+            }
+            if (j == out)continue;
+            move(cur->K+j, cur->K+cur->size, cur->K+out);
+            move(cur->V+j, cur->V+cur->size, cur->V+out);
+            removed += j-out;
+            pair_count -= j-out;
+            add_count(path, cur_index, -(int64_t) (j-out));
+            cur->size -= j-out;
+            saveNode(cur);
+            if (underfull(cur))rebalance_leaf(path, cur_index);
+        }
+        return removed;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    Node<KeyType, ValueType, Degree>* BPTree<KeyType, ValueType, WeakCmp, Degree>::find_leaf(const KeyType& key, bool lower,
+                                                                                             NodePtr* parent, size_t* slot) {
+        // internal nodes are released on the way down
+        NodePtr ptr = loadNode(top_target(key, lower)), above = nullptr;
+        while (ptr->type == Node<KeyType, ValueType, Degree>::INTERNAL) {
+            auto off = lower ? Search::lower(ptr->K, ptr->size, key, les) : Search::upper(ptr->K, ptr->size, key, les);
+            NodePtr next;
+            try {
+                next = loadChild(ptr, off);
+            } catch (...) {
+                releaseNode(ptr);
+                if (above)releaseNode(above);
+                throw;
+            }
+            if (above)releaseNode(above);
+            above = ptr;
+            if (slot)*slot = off;
+            ptr = next;
+        }
+        if (parent)*parent = above;
+        else if (above)releaseNode(above);
+        return ptr;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    Node<KeyType, ValueType, Degree>* BPTree<KeyType, ValueType, WeakCmp, Degree>::leaf_parent(NodePtr leaf, size_t& slot) {
+        if (!leaf->size)return nullptr;
+        NodePtr parent;
+        NodePtr found = find_leaf(leaf->K[0], true, &parent, &slot);
+        releaseNode(found);
+        if (!parent || found == leaf)return parent;
+        // equal keys may spread over several leaves, the descent ends at the first
+        for (slot = 0; slot <= parent->size; ++slot)
+            if (unswizzle(child(parent, slot)) == leaf->offset)return parent;
+        releaseNode(parent);
+        return nullptr;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::Cursor::step(bool forward) {
+        DiskLoc_T offset = forward ? leaf->next : leaf->prev;
+        tree->releaseNode(leaf);
+        // cleared first, the destructor must not release them again if a load throws
+        leaf = nullptr;
+        if (offset == Node<KeyType, ValueType, Degree>::NONE)return;
+        leaf = tree->loadNode(offset);
+        // the next child of the same parent, or a parent found by a new descent
+        size_t to = forward ? slot+1 : slot-1;
+        if (parent && (forward ? slot < parent->size : slot > 0) && unswizzle(child(parent, to)) == offset) {
+            slot = to;
+        } else {
+            if (parent)tree->releaseNode(parent);
+            parent = nullptr;
+            parent = tree->leaf_parent(leaf, slot);
+            ahead = slot;
+        }
+        read_ahead(forward);
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::Cursor::read_ahead(bool forward) {
+        if (forward != this->forward) {
+            // the scan turned, start over
+            this->forward = forward;
+            window = 0;
+            ahead = slot;
+        }
+        window = std::min(std::max<size_t>(2*window, 1), READ_AHEAD_MAX);
+        if (!parent) {
+            DiskLoc_T offset = forward ? leaf->next : leaf->prev;
+            if (offset != Node<KeyType, ValueType, Degree>::NONE)tree->prefetchNode(offset);
+            return;
+        }
+        // refill once half the window is used up, a batch of hints at a time
+        DiskLoc_T hints[READ_AHEAD_MAX];
+        size_t n = 0;
+        if (forward) {
+            size_t from = std::max(ahead, slot), to = std::min(slot+window, parent->size);
+            if (from-slot > window/2)return;
+            for (size_t i = from+1; i <= to; ++i)hints[n++] = unswizzle(child(parent, i));
+            ahead = std::max(from, to);
+        } else {
+            size_t from = std::min(ahead, slot), to = slot > window ? slot-window : 0;
+            if (slot-from > window/2)return;
+            for (size_t i = from; i-- > to;)hints[n++] = unswizzle(child(parent, i));
+            ahead = std::min(from, to);
+        }
+        if (n)tree->prefetchNodes(hints, n);
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::Cursor::settle_forward() {
+        // skip past the end of a leaf
+        while (leaf && index >= leaf->size) {
+            step(true);
+            index = 0;
+        }
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::Cursor::settle_backward() {
+        // index is one past the wanted position, step back over leaf boundaries
+        while (leaf && !index) {
+            step(false);
+            if (leaf)index = leaf->size;
+        }
+        if (leaf)--index;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::Cursor::next() {
+        ++index;
+        // a scan rather than a lookup, read ahead before the leaf runs out
+        if (!window && index == leaf->size/2)read_ahead(true);
+        settle_forward();
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::Cursor::prev() {
+        if (!window && index == (leaf->size+1)/2)read_ahead(false);
+        settle_backward();
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    typename BPTree<KeyType, ValueType, WeakCmp, Degree>::Cursor BPTree<KeyType, ValueType, WeakCmp, Degree>::cursor(const KeyType& low) {
+        Cursor c(this, std::shared_lock<std::shared_mutex>(latch));
+        if (root == Node<KeyType, ValueType, Degree>::NONE)
+            return c;
+        c.leaf = find_leaf(low, true, &c.parent, &c.slot);
+        c.ahead = c.slot;
+        c.index = Search::lower(c.leaf->K, c.leaf->size, low, les);
+        c.settle_forward();
+        return c;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    typename BPTree<KeyType, ValueType, WeakCmp, Degree>::Cursor BPTree<KeyType, ValueType, WeakCmp, Degree>::reverse_cursor(const KeyType& high) {
+        Cursor c(this, std::shared_lock<std::shared_mutex>(latch));
+        if (root == Node<KeyType, ValueType, Degree>::NONE)
+            return c;
+        c.leaf = find_leaf(high, false, &c.parent, &c.slot);
+        c.ahead = c.slot;
+        c.index = Search::upper(c.leaf->K, c.leaf->size, high, les);
+        c.settle_backward();
+        return c;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    uint64_t BPTree<KeyType, ValueType, WeakCmp, Degree>::rank_of(const KeyType& key, bool upper) {
+        // the pairs in the children left of the descent, then in the leaf below key
+        if (root == Node<KeyType, ValueType, Degree>::NONE)
+            return 0;
+        uint64_t n = 0;
+        NodePtr ptr = loadNode(root);
+        while (ptr->type == Node<KeyType, ValueType, Degree>::INTERNAL) {
+            auto off = upper ? Search::upper(ptr->K, ptr->size, key, les) : Search::lower(ptr->K, ptr->size, key, les);
+            if constexpr (ORDER_STATS) n = std::accumulate(ptr->counts, ptr->counts+off, n);
+            NodePtr next = loadChild(ptr, off);
+            releaseNode(ptr);
+            ptr = next;
+        }
+        n += upper ? Search::upper(ptr->K, ptr->size, key, les) : Search::lower(ptr->K, ptr->size, key, les);
+        releaseNode(ptr);
+        return n;
+    }
+
+#ifdef BPTREE_ORDER_STATS
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    typename BPTree<KeyType, ValueType, WeakCmp, Degree>::Cursor BPTree<KeyType, ValueType, WeakCmp, Degree>::select(uint64_t i) {
+        Cursor c(this, std::shared_lock<std::shared_mutex>(latch));
+        if (root == Node<KeyType, ValueType, Degree>::NONE)
+            return c;
+        NodePtr ptr = loadNode(root);
+        if (i >= subtree(ptr)) {
+            releaseNode(ptr);
+            return c;
+        }
+        // like find_leaf, the parent of the leaf stays loaded for read ahead
+        while (ptr->type == Node<KeyType, ValueType, Degree>::INTERNAL) {
+            size_t off = 0;
+            for (; off < ptr->size && i >= ptr->counts[off]; ++off)i -= ptr->counts[off];
+            NodePtr next = loadChild(ptr, off);
+            if (c.parent)releaseNode(c.parent);
+            c.parent = ptr;
+            c.slot = off;
+            ptr = next;
+        }
+        c.leaf = ptr;
+        c.ahead = c.slot;
+        c.index = i;
+        return c;
+    }
+#endif
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    std::vector<std::pair<KeyType, ValueType>> BPTree<KeyType, ValueType, WeakCmp, Degree>::range(KeyType low, KeyType high) {
         /*
          * low <= key <= high
          */
+        analysis::Timer timer(counters, analysis::OP_RANGE);
         decltype(range(KeyType(), KeyType())) ret;
-        NodePtr ptr = loadNode(root);
-        while (ptr->type == Node<KeyType, ValueType>::INTERNAL) {
-            int off = (les(ptr->K[0],low)) ? (int) (upper_bound(ptr->K, ptr->K+ptr->size, low,les)-ptr->K) : 0;
-            ptr = loadNode(ptr->sub_nodes[off]);
+        for (Cursor c = cursor(low); c.valid() && !les(high, c.key()); c.next())
+            ret.emplace_back(c.key(), c.value());
+        return ret;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    template<typename InputIt>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::bulk_load(InputIt first, InputIt last, double fill_factor) {
+        typedef Node<KeyType, ValueType, Degree> Node;
+        OpSync op_sync(this);
+        std::unique_lock<std::shared_mutex> guard(latch);
+        if (root != Node::NONE)
+            throw std::logic_error("BPTree: bulk_load() on non-empty tree");
+        if (first == last)
+            return;
+        // (separator, offset) of every node on the level being built
+        std::vector<std::pair<KeyType, DiskLoc_T>> level;
+        // pairs under every node of level, for ORDER_STATS
+        std::vector<uint64_t> level_pairs;
+        std::vector<std::pair<KeyType, ValueType>> pending;
+        DiskLoc_T prev = Node::NONE;
+        KeyType last_key;
+        // nodes of variable length keys are also filled up to fill_factor of their block
+        const auto budget = (size_t) (std::min(fill_factor, 1.0)*Node::BLOCK_SIZE);
+        auto emit_leaf = [&](size_t from, size_t to) {
+            NodePtr leaf = initNode(Node::LEAF);
+            for (size_t i = from; i < to; ++i) {
+                leaf->K[i-from] = pending[i].first;
+                leaf->V[i-from] = pending[i].second;
+            }
+            leaf->size = to-from;
+            ++leaf_count;
+            pair_count += leaf->size;
+            leaf->prev = prev;
+            leaf->next = Node::NONE;
+            saveNode(leaf);
+            level.emplace_back(prev == Node::NONE ? leaf->K[0] : key_traits<KeyType>::separator(last_key, leaf->K[0]),
+                               leaf->offset);
+            if constexpr (ORDER_STATS) level_pairs.push_back(leaf->size);
+            last_key = leaf->K[leaf->size-1];
+            NodePtr prev_leaf = nullptr;
+            if (prev != Node::NONE) {
+                prev_leaf = loadNode(prev);
+                prev_leaf->next = leaf->offset;
+                saveNode(prev_leaf);
+            }
+            commitOp();
+            if (prev_leaf)releaseNode(prev_leaf);
+            releaseNode(leaf);
+            prev = level.back().second;
+        };
+        // out of order input, free the leaves written so far
+        auto take = [&](const KeyType& key, const ValueType& value) {
+            if (!pending.empty() && les(key, pending.back().first)) {
+                for (auto& l : level) {
+                    NodePtr leaf = loadNode(l.second);
+                    --leaf_count;
+                    pair_count -= leaf->size;
+                    deleteNode(leaf);
+                    commitOp();
+                    releaseNode(leaf);
+                }
+                throw std::logic_error("BPTree: bulk_load() input is not sorted");
+            }
+            pending.emplace_back(key, value);
+        };
+        /*
+         * Keep LEAF_MIN_ENTRY pairs in reserve so that the last leaf never underflows:
+         * the tail is either one leaf or split evenly into two.
+         */
+        const size_t leaf_fill = fill_count(fill_factor, LEAF_MIN_ENTRY, LEAF_MAX_ENTRY);
+        if constexpr (VARIABLE) {
+            // no minimum to keep, a leaf ends where the next pair would go over
+            Encoding e(true);
+            for (; first != last; ++first) {
+                take(first->first, first->second);
+                if (e.count && (e.count == leaf_fill || Encoding(e).add(pending.back().first).size() > budget)) {
+                    emit_leaf(0, pending.size()-1);
+                    pending.erase(pending.begin(), pending.end()-1);
+                    e = Encoding(true);
+                }
+                e.add(pending.back().first);
+            }
+            emit_leaf(0, pending.size());
+        } else {
+            for (; first != last; ++first) {
+                take(first->first, first->second);
+                if (pending.size() == leaf_fill+LEAF_MIN_ENTRY) {
+                    emit_leaf(0, leaf_fill);
+                    pending.erase(pending.begin(), pending.begin()+leaf_fill);
+                }
+            }
+            if (pending.size() <= LEAF_MAX_ENTRY) {
+                emit_leaf(0, pending.size());
+            } else {
+                emit_leaf(0, pending.size()/2);
+                emit_leaf(pending.size()/2, pending.size());
+            }
         }
-        for (int i = (int) (lower_bound(ptr->K, ptr->K+ptr->size, low,les)-ptr->K); i < ptr->size; ++i) {
-            if (les(high ,ptr->K[i]))goto FIN;
-            ret.emplace_back(ptr->K[i], ptr->V[i]);
+
+        // internal levels, a node of c children holds c-1 keys
+        const size_t min_children = INTERNAL_MIN_ENTRY+1, max_children = INTERNAL_MAX_ENTRY+1;
+        const size_t children_fill = fill_count(fill_factor, INTERNAL_MIN_ENTRY, INTERNAL_MAX_ENTRY)+1;
+        while (level.size() > 1) {
+            decltype(level) upper;
+            decltype(level_pairs) upper_pairs;
+            auto emit_internal = [&](size_t from, size_t to) {
+                NodePtr node = initNode(Node::INTERNAL);
+                node->prev = node->next = Node::NONE;
+                node->sub_nodes[0] = level[from].second;
+                for (size_t i = from+1; i < to; ++i) {
+                    node->K[i-from-1] = level[i].first;
+                    node->sub_nodes[i-from] = level[i].second;
+                }
+                node->size = to-from-1;
+                if constexpr (ORDER_STATS) {
+                    std::copy(level_pairs.begin()+from, level_pairs.begin()+to, node->counts);
+                    upper_pairs.push_back(subtree(node));
+                }
+                saveNode(node);
+                upper.emplace_back(level[from].first, node->offset);
+                commitOp();
+                releaseNode(node);
+            };
+            size_t i = 0;
+            if constexpr (VARIABLE) {
+                while (i < level.size()) {
+                    // at least two children, so that every level shrinks
+                    Encoding e(false);
+                    size_t to = i+1;
+                    for (; to < level.size() && to-i < children_fill; ++to) {
+                        if (to-i > 1 && Encoding(e).add(level[to].first).size() > budget)break;
+                        e.add(level[to].first);
+                    }
+                    emit_internal(i, to);
+                    i = to;
+                }
+            } else {
+                for (; level.size()-i >= children_fill+min_children; i += children_fill)
+                    emit_internal(i, i+children_fill);
+                size_t rest = level.size()-i;
+                if (rest <= max_children) {
+                    emit_internal(i, level.size());
+                } else {
+                    emit_internal(i, i+rest/2);
+                    emit_internal(i+rest/2, level.size());
+                }
+            }
+            level.swap(upper);
+            level_pairs.swap(upper_pairs);
         }
-        while (ptr->next != Node<KeyType, ValueType>::NONE) {
-            ptr = loadNode(ptr->next);
-            for (int i = 0; i < ptr->size; ++i) {
-                if (les(high, ptr->K[i]))goto FIN;
-                ret.emplace_back(ptr->K[i], ptr->V[i]);
+        root = level[0].second;
+        drop_top();
+        commitOp();
+        ++changes;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::scan_layout(Layout& layout, size_t placed) {
+        size_t count = blockCount();
+        layout.order.clear();
+        layout.loc.assign(count, NO_BLOCK);
+        layout.at.assign(count, NO_BLOCK);
+        layout.parent.assign(count, NO_BLOCK);
+        if (root == NodeT::NONE)return;
+        int height = this->height();
+        // breadth first, the last level is the leaves in key order, known from their parents without loading them
+        layout.order.push_back(block_of(root));
+        for (size_t i = 0, level_end = 1, depth = 0; i < layout.order.size(); ++i) {
+            if (i == level_end) {
+                level_end = layout.order.size();
+                ++depth;
+            }
+            if ((int) depth+1 == height)break;
+            NodePtr node = loadNode(blockOffset(layout.order[i]));
+            for (size_t j = 0; j <= node->size; ++j) {
+                size_t b = block_of(unswizzle(child(node, j)));
+                layout.parent[b] = layout.order[i];
+                layout.order.push_back(b);
             }
+            releaseNode(node);
         }
-        FIN:
-        return ret;
+        for (size_t b : layout.order)layout.loc[b] = layout.at[b] = b;
+        if (!placed)return;
+        // blocks placed before writers ran stay put, holes they left included, the rest keeps its order behind them
+        std::vector<size_t> order(placed);
+        for (size_t i = 0; i < placed; ++i)order[i] = layout.at[i];
+        for (size_t b : layout.order)
+            if (b >= placed)order.push_back(b);
+        layout.order.swap(order);
     }
 
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::move_node(Layout& layout, size_t slot, NodeT* spare) {
+        size_t node = layout.order[slot], from = layout.loc[node], other = layout.at[slot];
+        DiskLoc_T a = blockOffset(from), b = blockOffset(slot);
+        auto remap = [a, b](DiskLoc_T offset) { return offset == a ? b : offset == b ? a : offset; };
+        Path path(this, true);
+        // swap the two blocks, whatever is in the slot, live or free, goes where the node was
+        NodePtr at_a = load(path, a), at_b = load(path, b);
+        copy_node(spare, at_b);
+        copy_node(at_b, at_a);
+        copy_node(at_a, spare);
+        at_a->offset = a;
+        at_b->offset = b;
+        // then everything pointing at either: the two themselves, their parents and their neighbours in the leaf chain
+        std::vector<DiskLoc_T> referrers{a, b};
+        for (size_t n : {node, other})
+            if (n != NO_BLOCK && layout.parent[n] != NO_BLOCK)
+                referrers.push_back(remap(blockOffset(layout.loc[layout.parent[n]])));
+        for (NodePtr moved : {at_a, at_b}) {
+            if (moved->type != NodeT::LEAF)continue;
+            if (moved->prev != NodeT::NONE)referrers.push_back(remap(moved->prev));
+            if (moved->next != NodeT::NONE)referrers.push_back(remap(moved->next));
+        }
+        std::sort(referrers.begin(), referrers.end());
+        referrers.erase(std::unique(referrers.begin(), referrers.end()), referrers.end());
+        for (DiskLoc_T offset : referrers) {
+            NodePtr ptr = offset == a ? at_a : offset == b ? at_b : load(path, offset);
+            if (ptr->type == NodeT::LEAF) {
+                ptr->prev = remap(ptr->prev);
+                ptr->next = remap(ptr->next);
+            } else if (ptr->type == NodeT::INTERNAL) {
+                for (size_t j = 0; j <= ptr->size; ++j) {
+                    DiskLoc_T c = unswizzle(child(ptr, j));
+                    if (remap(c) != c)ptr->sub_nodes[j] = remap(c);
+                }
+            }
+            saveNode(ptr);
+        }
+        root = remap(root);
+        if (at_a->type == NodeT::INTERNAL || at_b->type == NodeT::INTERNAL)drop_top();
+        layout.loc[node] = slot;
+        layout.at[slot] = node;
+        layout.at[from] = other;
+        if (other != NO_BLOCK)layout.loc[other] = from;
+    }
 
-    template<typename KeyType, typename ValueType>
-    void writeBuffer(const Node<KeyType, ValueType>* node,char* buf) {
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    size_t BPTree<KeyType, ValueType, WeakCmp, Degree>::finish_compaction(const Layout& layout) {
+        size_t end = layout.at.size();
+        while (end && layout.at[end-1] == NO_BLOCK)--end;
+        setBlocks(end);
+        // holes left by an early stop go back on the freelist
+        for (size_t i = 0; i < end; ++i) {
+            if (layout.at[i] != NO_BLOCK)continue;
+            Path path(this, true);
+            discard(path, load(path, blockOffset(i)));
+        }
+        compacted();
+        return layout.at.size()-end;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    size_t BPTree<KeyType, ValueType, WeakCmp, Degree>::compact(const std::function<bool(size_t, size_t)>& progress, size_t step) {
+        std::unique_ptr<NodeT> spare(new NodeT);
+        Layout layout;
+        size_t placed = 0, cut = 0;
+        uint64_t seen = 0;
+        bool scanned = false, stop = false;
+        for (;;) {
+            bool done;
+            {
+                OpSync op_sync(this);
+                std::unique_lock<std::shared_mutex> guard(latch);
+                if (!scanned || changes != seen) {
+                    // free blocks are the compaction's until it ends, writers in between extend the file
+                    setBlocks(blockCount());
+                    scan_layout(layout, placed);
+                    scanned = true;
+                }
+                for (size_t moved = 0; !stop && placed < layout.order.size() && moved < std::max<size_t>(step, 1); ++placed) {
+                    if (layout.loc[layout.order[placed]] == placed)continue;
+                    move_node(layout, placed, spare.get());
+                    ++moved;
+                }
+                done = stop || placed == layout.order.size();
+                if (done)cut = finish_compaction(layout);
+                seen = changes;
+            }
+            stop = progress && !progress(placed, layout.order.size());
+            if (done)return cut;
+        }
+    }
+
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::copy_node(NodeT* dst, const NodeT* src) {
+        dst->type = src->type;
+        dst->offset = src->offset;
+        dst->next = src->next;
+        dst->prev = src->prev;
+        dst->size = src->size;
+        if (src->type == NodeT::FREE)return;
+        std::copy(src->K, src->K+src->size, dst->K);
+        if (src->type == NodeT::LEAF)std::copy(src->V, src->V+src->size, dst->V);
+        else {
+            for (size_t i = 0; i <= src->size; ++i)dst->sub_nodes[i] = unswizzle(child(src, i));
+            if constexpr (ORDER_STATS) std::copy(src->counts, src->counts+src->size+1, dst->counts);
+        }
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    bool BPTree<KeyType, ValueType, WeakCmp, Degree>::same_node(const NodeT* a, const NodeT* b) {
+        if (a->type != b->type || a->next != b->next)return false;
+        if (a->type == NodeT::FREE)return true;
+        if (a->prev != b->prev || a->size != b->size || memcmp((void*) a->K, (void*) b->K, sizeof(KeyType)*a->size))return false;
+        if (a->type == NodeT::LEAF)return !memcmp((void*) a->V, (void*) b->V, sizeof(ValueType)*a->size);
+        for (size_t i = 0; i <= a->size; ++i)
+            if (unswizzle(a->sub_nodes[i]) != unswizzle(b->sub_nodes[i]))return false;
+        if constexpr (ORDER_STATS) return std::equal(a->counts, a->counts+a->size+1, b->counts);
+        return true;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::keep_versions(Path& path) {
+        // the writer holds the tree exclusively, so before[] and held[] line up
+        std::lock_guard<std::mutex> guard(versions_lock);
+        size_t b = 0;
+        for (size_t i = 0; i < path.held_count; ++i) {
+            NodePtr node = path.held[i];
+            if (std::find(path.held, path.held+i, node) != path.held+i)continue;
+            auto& pre = path.before[b++];
+            // only the first change since the newest snapshot is kept
+            if (!same_node(pre.get(), node))versions.emplace(std::make_pair(pre->offset, version), std::move(pre));
+        }
+        // the oldest snapshots need the most copies, and the newest may still need the ones just kept
+        while (versions.size() > version_limit && !snapshots.empty()) {
+            uint64_t oldest = *snapshots.begin();
+            expired.insert(oldest);
+            snapshots.erase(oldest);
+            drop_versions();
+        }
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::read_version(DiskLoc_T ref, uint64_t at, NodeT* out) {
+        std::shared_lock<std::shared_mutex> guard(latch);
+        {
+            // the first version kept after the snapshot is the node as the snapshot saw it
+            std::lock_guard<std::mutex> versions_guard(versions_lock);
+            if (expired.count(at))
+                throw std::runtime_error("BPTree: snapshot expired, writers changed more nodes than the version limit");
+            auto iter = versions.upper_bound({unswizzle(ref), at});
+            if (iter != versions.end() && iter->first.first == unswizzle(ref)) {
+                copy_node(out, iter->second.get());
+                return;
+            }
+        }
+        NodePtr node = loadNode(ref);
+        copy_node(out, node);
+        releaseNode(node);
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::close_snapshot(uint64_t at) {
+        std::lock_guard<std::mutex> guard(versions_lock);
+        if (expired.erase(at))return;
+        snapshots.erase(snapshots.find(at));
+        drop_versions();
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::drop_versions() {
+        // a version is needed by the snapshots taken before it
+        uint64_t oldest = snapshots.empty() ? UINT64_MAX : *snapshots.begin();
+        for (auto iter = versions.begin(); iter != versions.end();)
+            iter = iter->first.second <= oldest ? versions.erase(iter) : ++iter;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::count_leaves() {
+        // taken exclusively, along the leaf chain from the leftmost leaf
+        leaf_count = pair_count = 0;
+        NodePtr ptr = root == NodeT::NONE ? nullptr : loadNode(root);
+        while (ptr && ptr->type == NodeT::INTERNAL) {
+            NodePtr next = loadChild(ptr, 0);
+            releaseNode(ptr);
+            ptr = next;
+        }
+        while (ptr) {
+            ++leaf_count;
+            pair_count += ptr->size;
+            DiskLoc_T next = ptr->next;
+            releaseNode(ptr);
+            ptr = next == NodeT::NONE ? nullptr : loadNode(next);
+        }
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    analysis::Snapshot BPTree<KeyType, ValueType, WeakCmp, Degree>::stats() {
+        analysis::Snapshot s;
+        counters.snapshot(s);
+        std::shared_lock<std::shared_mutex> guard(latch);
+        if (!shape_known) {
+            // once per tree, writers keep the counts from then on
+            guard.unlock();
+            {
+                std::unique_lock<std::shared_mutex> exclusive(latch);
+                if (!shape_known)count_leaves();
+                shape_known = true;
+            }
+            guard.lock();
+        }
+        s.height = height();
+        s.leaves = leaf_count;
+        s.pairs = pair_count;
+        s.fill_factor = leaf_count ? (double) pair_count/(double) (leaf_count*LEAF_MAX_ENTRY) : 0;
+        return s;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    typename BPTree<KeyType, ValueType, WeakCmp, Degree>::Snapshot BPTree<KeyType, ValueType, WeakCmp, Degree>::snapshot() {
+        // no writer is halfway through
+        std::shared_lock<std::shared_mutex> guard(latch);
+        std::lock_guard<std::mutex> versions_guard(versions_lock);
+        snapshots.insert(version);
+        // changes from now on are kept under the next version
+        return Snapshot(this, version++, root);
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::Snapshot::descend(const KeyType& key, bool lower, NodeT* out) const {
+        tree->read_version(root, at, out);
+        while (out->type == NodeT::INTERNAL) {
+            size_t off = lower ? Search::lower(out->K, out->size, key, tree->les) : Search::upper(out->K, out->size, key, tree->les);
+            tree->read_version(out->sub_nodes[off], at, out);
+        }
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    std::pair<ValueType, bool> BPTree<KeyType, ValueType, WeakCmp, Degree>::Snapshot::search(const KeyType& key) const {
+        if (root == NodeT::NONE)return {ValueType(), false};
+        std::unique_ptr<NodeT> leaf(new NodeT);
+        descend(key, false, leaf.get());
+        size_t i = Search::lower(leaf->K, leaf->size, key, tree->les);
+        if (i < leaf->size && key == leaf->K[i])
+            return {leaf->V[i], true};
+        return {ValueType(), false};
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::Snapshot::Cursor::settle() {
+        while (leaf && index == leaf->size) {
+            if (leaf->next == NodeT::NONE) {
+                leaf.reset();
+                return;
+            }
+            snapshot->tree->read_version(leaf->next, snapshot->at, leaf.get());
+            index = 0;
+        }
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    void BPTree<KeyType, ValueType, WeakCmp, Degree>::Snapshot::Cursor::next() {
+        ++index;
+        settle();
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    typename BPTree<KeyType, ValueType, WeakCmp, Degree>::Snapshot::Cursor
+    BPTree<KeyType, ValueType, WeakCmp, Degree>::Snapshot::cursor(const KeyType& low) const {
+        Cursor c(this);
+        if (root == NodeT::NONE) {
+            c.leaf.reset();
+            return c;
+        }
+        descend(low, true, c.leaf.get());
+        c.index = Search::lower(c.leaf->K, c.leaf->size, low, tree->les);
+        c.settle();
+        return c;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    std::vector<std::pair<KeyType, ValueType>>
+    BPTree<KeyType, ValueType, WeakCmp, Degree>::Snapshot::range(const KeyType& low, const KeyType& high) const {
+        std::vector<std::pair<KeyType, ValueType>> result;
+        for (Cursor c = cursor(low); c.valid() && !tree->les(high, c.key()); c.next())
+            result.emplace_back(c.key(), c.value());
+        return result;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    std::vector<KeyType>
+    BPTree<KeyType, ValueType, WeakCmp, Degree>::Snapshot::split(const KeyType& low, const KeyType& high, size_t parts) const {
+        std::vector<KeyType> found, below_found, cuts;
+        if (root == NodeT::NONE || parts < 2 || tree->les(high, low))return cuts;
+        // the nodes of one level overlapping the range, left to right, and the separators between them
+        std::vector<DiskLoc_T> level{root}, below;
+        std::unique_ptr<NodeT> node(new NodeT);
+        while (found.size()+1 < parts) {
+            below.clear();
+            below_found.clear();
+            for (size_t j = 0; j < level.size(); ++j) {
+                tree->read_version(level[j], at, node.get());
+                // the level below would be leaves
+                if (node->type != NodeT::INTERNAL)break;
+                // child i holds the keys from K[i-1] up to K[i]
+                for (size_t i = 0; i <= node->size; ++i) {
+                    if (i && tree->les(high, node->K[i-1]))break;
+                    if (i < node->size && !tree->les(low, node->K[i]))continue;
+                    if (!below.empty())below_found.push_back(i ? node->K[i-1] : found[j-1]);
+                    below.push_back(unswizzle(node->sub_nodes[i]));
+                }
+            }
+            if (node->type != NodeT::INTERNAL)break;
+            level.swap(below);
+            found.swap(below_found);
+        }
+        if (found.size()+1 <= parts) {
+            cuts = std::move(found);
+        } else {
+            for (size_t i = 1; i < parts; ++i)cuts.push_back(found[i*found.size()/parts]);
+        }
+        // equal separators of duplicate keys would make empty parts
+        cuts.erase(std::unique(cuts.begin(), cuts.end(), [this](const KeyType& a, const KeyType& b) {
+            return !tree->les(a, b);
+        }), cuts.end());
+        return cuts;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    size_t BPTree<KeyType, ValueType, WeakCmp, Degree>::Snapshot::parallel_range(
+            const KeyType& low, const KeyType& high, size_t parts,
+            const std::function<void(size_t, const KeyType&, const ValueType&)>& fn) const {
+        if (tree->les(high, low))return 0;
+        std::vector<KeyType> cuts = split(low, high, parts);
+        std::atomic<bool> failed(false);
+        std::exception_ptr error;
+        std::mutex error_lock;
+        // part p holds cuts[p-1] <= key < cuts[p], the first from low and the last up to high
+        auto scan = [&](size_t p) {
+            try {
+                for (Cursor c = cursor(p ? cuts[p-1] : low); c.valid() && !failed.load(std::memory_order_relaxed); c.next()) {
+                    if (p < cuts.size() ? !tree->les(c.key(), cuts[p]) : tree->les(high, c.key()))break;
+                    fn(p, c.key(), c.value());
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if (!failed.exchange(true))error = std::current_exception();
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t p = 1; p <= cuts.size(); ++p)workers.emplace_back(scan, p);
+        scan(0);
+        for (auto& w : workers)w.join();
+        if (error)std::rethrow_exception(error);
+        return cuts.size()+1;
+    }
+
+    template<typename KeyType, typename ValueType, typename WeakCmp, size_t Degree>
+    std::vector<std::pair<KeyType, ValueType>>
+    BPTree<KeyType, ValueType, WeakCmp, Degree>::Snapshot::parallel_range(const KeyType& low, const KeyType& high, size_t parts) const {
+        std::vector<std::vector<std::pair<KeyType, ValueType>>> found(std::max(parts, (size_t) 1));
+        size_t n = parallel_range(low, high, parts, [&found](size_t p, const KeyType& key, const ValueType& value) {
+            found[p].emplace_back(key, value);
+        });
+        std::vector<std::pair<KeyType, ValueType>> result;
+        size_t total = 0;
+        for (size_t p = 0; p < n; ++p)total += found[p].size();
+        result.reserve(total);
+        for (size_t p = 0; p < n; ++p)result.insert(result.end(), found[p].begin(), found[p].end());
+        return result;
+    }
+
+    // the first n child offsets, unswizzled
+    template<typename KeyType, typename ValueType, size_t Degree>
+    char* write_children(const Node<KeyType, ValueType, Degree>* node, size_t n, char* buf) {
+        for (size_t i = 0; i < n; ++i, buf += sizeof(DiskLoc_T)) {
+            DiskLoc_T offset = unswizzle(__atomic_load_n(&node->sub_nodes[i], __ATOMIC_RELAXED));
+            memcpy(buf, &offset, sizeof(offset));
+        }
+        return buf;
+    }
+
+    // with ORDER_STATS, the pair counts of the first n children, stored behind their offsets
+    template<typename KeyType, typename ValueType, size_t Degree>
+    char* write_counts(const Node<KeyType, ValueType, Degree>* node, size_t n, char* buf) {
+        if constexpr (ORDER_STATS) {
+            memcpy(buf, (void*) node->counts, sizeof(uint64_t)*n);
+            buf += sizeof(uint64_t)*n;
+        }
+        return buf;
+    }
+
+    template<typename KeyType, typename ValueType, size_t Degree>
+    const char* read_counts(Node<KeyType, ValueType, Degree>* node, size_t n, const char* buf) {
+        if constexpr (ORDER_STATS) {
+            memcpy((void*) node->counts, buf, sizeof(uint64_t)*n);
+            buf += sizeof(uint64_t)*n;
+        }
+        return buf;
+    }
+
+    template<typename KeyType, typename ValueType, size_t Degree>
+    void writeBuffer(const Node<KeyType, ValueType, Degree>* node,char* buf) {
 # define write_attribute(ATTR) memcpy(buf,(void*)&node->ATTR,sizeof(node->ATTR));buf+=sizeof(node->ATTR)
         write_attribute(type);
         write_attribute(offset);
         write_attribute(next);
-        if (node->type == Node<KeyType, ValueType>::FREE)
+        if (node->type == Node<KeyType, ValueType, Degree>::FREE)
             return;
         write_attribute(prev);
         write_attribute(size);
-        memcpy(buf, (void*) &node->K, sizeof(KeyType)*DEGREE);
-        buf += sizeof(KeyType)*DEGREE;
-        if (node->type == Node<KeyType, ValueType>::LEAF)
-            memcpy(buf, (void*) &node->V, sizeof(ValueType)*DEGREE);
+        if constexpr (key_traits<KeyType>::variable) {
+            // prefix compressed keys, then the entries packed behind them
+            buf = key_traits<KeyType>::encode(node->K, node->size, buf);
+            if (node->type == Node<KeyType, ValueType, Degree>::LEAF)
+                memcpy(buf, (void*) &node->V, sizeof(ValueType)*node->size);
+            else
+                write_counts(node, node->size+1, write_children(node, node->size+1, buf));
+            return;
+        }
+        memcpy(buf, (void*) &node->K, sizeof(KeyType)*Degree);
+        buf += sizeof(KeyType)*Degree;
+        if (node->type == Node<KeyType, ValueType, Degree>::LEAF)
+            memcpy(buf, (void*) &node->V, sizeof(ValueType)*Degree);
         else
-            memcpy(buf, (void*) &node->sub_nodes, sizeof(DiskLoc_T)*DEGREE);
+            write_counts(node, Degree, write_children(node, Degree, buf));
 #undef write_attribute
     }
 
-    template<typename KeyType, typename ValueType>
-    void readBuffer(Node<KeyType, ValueType>* node, char* buf) {
+    template<typename KeyType, typename ValueType, size_t Degree>
+    void readBuffer(Node<KeyType, ValueType, Degree>* node, char* buf) {
 #define read_attribute(ATTR) memcpy((void*)&node->ATTR,buf,sizeof(node->ATTR));buf+=sizeof(node->ATTR)
         read_attribute(type);
         read_attribute(offset);
         read_attribute(next);
-        if (node->type == Node<KeyType, ValueType>::FREE)
+        if (node->type == Node<KeyType, ValueType, Degree>::FREE)
             return;
         read_attribute(prev);
         read_attribute(size);
+        if constexpr (key_traits<KeyType>::variable) {
+            const char* entries = key_traits<KeyType>::decode(node->K, node->size, buf);
+            if (node->type == Node<KeyType, ValueType, Degree>::LEAF)
+                memcpy((void*) node->V, entries, sizeof(ValueType)*node->size);
+            else {
+                memcpy((void*) node->sub_nodes, entries, sizeof(DiskLoc_T)*(node->size+1));
+                read_counts(node, node->size+1, entries+sizeof(DiskLoc_T)*(node->size+1));
+            }
+            return;
+        }
         memcpy((void*) node->K, buf, sizeof(KeyType)*node->size);
-        buf += sizeof(KeyType)*DEGREE;
-        if (node->type == Node<KeyType, ValueType>::LEAF)
+        buf += sizeof(KeyType)*Degree;
+        if (node->type == Node<KeyType, ValueType, Degree>::LEAF)
             memcpy((void*) node->V, buf, sizeof(ValueType)*node->size);
-        else
+        else {
             memcpy((void*) node->sub_nodes, buf, sizeof(DiskLoc_T)*(node->size+1));
+            read_counts(node, node->size+1, buf+sizeof(DiskLoc_T)*Degree);
+        }
 #undef read_attribute
     }
 
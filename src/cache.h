@@ -6,125 +6,610 @@
 #define BPTREE_CACHE_H
 
 #include <functional>
-#include "../include/unordered_map.h"
-//#include "analysis.h"
-//Debug::Count __Counter;
+#include <algorithm>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <stdexcept>
+#include "analysis.h"
 namespace cache{
 
     template <typename DiskLoc_T,typename T>
     using func_expire_t =std::function<void(DiskLoc_T,const T*)>;
     template <typename DiskLoc_T,typename T>
     using func_load_t=std::function<void(DiskLoc_T, T*)>;
+    // blocks classified hot (e.g. internal nodes) are evicted only when no cold block can be
+    template <typename T>
+    using func_hot_t=std::function<bool(const T*)>;
+
+    typedef enum {
+        LRU, CLOCK, TWO_Q
+    } policy_t;
+
+    /*
+     * Replacement state over the slots 1..count of a cache, slot 0 is never handed out.
+     */
+    template <typename DiskLoc_T>
+    class ReplacementPolicy {
+    public:
+        virtual ~ReplacementPolicy() = default;
+
+        // a block was loaded into slot
+        virtual void admit(size_t slot, DiskLoc_T where) = 0;
+
+        virtual void touch(size_t slot) = 0;
+
+        // slot was emptied, either evicted or removed by the user
+        virtual void erase(size_t slot) = 0;
+
+        // @return the slot to evict among those accepted by evictable, 0 if there is none
+        virtual size_t victim(const std::function<bool(size_t)>& evictable) = 0;
+
+        // visit resident slots roughly in eviction order until visit returns false, without changing the state
+        virtual void walk_cold(const std::function<bool(size_t)>& visit) = 0;
+    };
+
+    /*
+     * doubly linked list over slots, index 0 is the sentinel
+     */
+    class SlotList {
+        std::vector<size_t> next, prev;
+    public:
+        explicit SlotList(size_t count) : next(count+1, 0), prev(count+1, 0) {}
+
+        void push_front(size_t slot) {
+            next[slot] = next[0];
+            prev[slot] = 0;
+            prev[next[0]] = slot;
+            next[0] = slot;
+        }
+
+        void erase(size_t slot) {
+            next[prev[slot]] = next[slot];
+            prev[next[slot]] = prev[slot];
+        }
+
+        // walk from the least recent end
+        size_t find_back(const std::function<bool(size_t)>& pred) const {
+            size_t slot = prev[0];
+            while (slot && !pred(slot))slot = prev[slot];
+            return slot;
+        }
+    };
+
+    template <typename DiskLoc_T>
+    class LRUPolicy : public ReplacementPolicy<DiskLoc_T> {
+        SlotList list;
+    public:
+        explicit LRUPolicy(size_t count) : list(count) {}
+
+        void admit(size_t slot, DiskLoc_T) override { list.push_front(slot); }
+
+        void touch(size_t slot) override {
+            list.erase(slot);
+            list.push_front(slot);
+        }
+
+        void erase(size_t slot) override { list.erase(slot); }
+
+        size_t victim(const std::function<bool(size_t)>& evictable) override { return list.find_back(evictable); }
+
+        void walk_cold(const std::function<bool(size_t)>& visit) override {
+            list.find_back([&](size_t slot) { return !visit(slot); });
+        }
+    };
+
+    /*
+     * CLOCK: a hit only sets a reference bit, the hand clears bits until it finds an unreferenced block
+     */
+    template <typename DiskLoc_T>
+    class ClockPolicy : public ReplacementPolicy<DiskLoc_T> {
+        std::vector<char> referenced, resident;
+        size_t hand;
+    public:
+        explicit ClockPolicy(size_t count) : referenced(count+1, 0), resident(count+1, 0), hand(0) {}
+
+        void admit(size_t slot, DiskLoc_T) override {
+            resident[slot] = 1;
+            referenced[slot] = 1;
+        }
+
+        void touch(size_t slot) override { referenced[slot] = 1; }
+
+        void erase(size_t slot) override { resident[slot] = 0; }
+
+        size_t victim(const std::function<bool(size_t)>& evictable) override {
+            const size_t count = resident.size()-1;
+            // two sweeps clear every bit once, the third one must find a block if any is evictable
+            for (size_t step = 0; step < 3*count; ++step) {
+                hand = hand%count+1;
+                if (!resident[hand] || !evictable(hand))continue;
+                if (!referenced[hand])return hand;
+                referenced[hand] = 0;
+            }
+            return 0;
+        }
+
+        void walk_cold(const std::function<bool(size_t)>& visit) override {
+            // ahead of the hand, unreferenced blocks go first
+            const size_t count = resident.size()-1;
+            for (char pass = 0; pass < 2; ++pass)
+                for (size_t step = 1; step <= count; ++step) {
+                    size_t slot = (hand+step-1)%count+1;
+                    if (resident[slot] && referenced[slot] == pass && !visit(slot))return;
+                }
+        }
+    };
+
+    /*
+     * 2Q: first-time blocks enter a FIFO (A1in) and are remembered for a while after eviction (A1out).
+     * Only a block missed again while remembered enters the LRU main queue (Am),
+     * so a single long scan passes through A1in without flushing Am.
+     */
+    template <typename DiskLoc_T>
+    class TwoQPolicy : public ReplacementPolicy<DiskLoc_T> {
+        typedef enum {
+            NONE, A1IN, AM
+        } queue_t;
+
+        SlotList a1in, am;
+        std::vector<queue_t> queue;
+        std::vector<DiskLoc_T> where;
+        size_t a1in_size, a1in_max;
+        std::deque<DiskLoc_T> a1out;
+        size_t a1out_max;
+        std::unordered_map<DiskLoc_T, size_t> remembered;
+
+        void remember(DiskLoc_T offset) {
+            a1out.push_back(offset);
+            ++remembered[offset];
+            if (a1out.size() > a1out_max) {
+                if (!--remembered[a1out.front()])remembered.erase(a1out.front());
+                a1out.pop_front();
+            }
+        }
+
+    public:
+        explicit TwoQPolicy(size_t count) : a1in(count), am(count), queue(count+1, NONE), where(count+1),
+                                            a1in_size(0), a1in_max(std::max<size_t>(1, count/4)),
+                                            a1out_max(std::max<size_t>(1, count/2)) {}
+
+        void admit(size_t slot, DiskLoc_T offset) override {
+            where[slot] = offset;
+            auto iter = remembered.find(offset);
+            if (iter != remembered.end()) {
+                queue[slot] = AM;
+                am.push_front(slot);
+            } else {
+                queue[slot] = A1IN;
+                a1in.push_front(slot);
+                ++a1in_size;
+            }
+        }
+
+        void touch(size_t slot) override {
+            // hits in A1in are correlated references and don't promote
+            if (queue[slot] == AM) {
+                am.erase(slot);
+                am.push_front(slot);
+            }
+        }
+
+        void erase(size_t slot) override {
+            if (queue[slot] == A1IN) {
+                a1in.erase(slot);
+                --a1in_size;
+            } else if (queue[slot] == AM) {
+                am.erase(slot);
+            }
+            queue[slot] = NONE;
+        }
+
+        size_t victim(const std::function<bool(size_t)>& evictable) override {
+            size_t slot = 0;
+            if (a1in_size > a1in_max)slot = a1in.find_back(evictable);
+            if (!slot)slot = am.find_back(evictable);
+            if (!slot)slot = a1in.find_back(evictable);
+            if (slot && queue[slot] == A1IN)remember(where[slot]);
+            return slot;
+        }
+
+        void walk_cold(const std::function<bool(size_t)>& visit) override {
+            bool go = true;
+            a1in.find_back([&](size_t slot) { return !(go = visit(slot)); });
+            if (go)am.find_back([&](size_t slot) { return !visit(slot); });
+        }
+    };
+
+    template <typename DiskLoc_T>
+    std::unique_ptr<ReplacementPolicy<DiskLoc_T>> make_policy(policy_t policy, size_t count) {
+        switch (policy) {
+            case CLOCK:
+                return std::unique_ptr<ReplacementPolicy<DiskLoc_T>>(new ClockPolicy<DiskLoc_T>(count));
+            case TWO_Q:
+                return std::unique_ptr<ReplacementPolicy<DiskLoc_T>>(new TwoQPolicy<DiskLoc_T>(count));
+            default:
+                return std::unique_ptr<ReplacementPolicy<DiskLoc_T>>(new LRUPolicy<DiskLoc_T>(count));
+        }
+    }
 
     template <typename DiskLoc_T,typename T>
-    class LRUCache {
+    class BlockCache {
     private:
         /*
-         * flag for double-linked list and freelist
+         * flag for freelist
          */
         typedef T* DataPtr;
         const static size_t LIST_END = 0;
+        // how long a miss waits for a block to be unpinned before it gives up
+        static constexpr std::chrono::milliseconds PIN_WAIT{1000};
 
         struct Block {
-            size_t next;
-            size_t prev;
+            size_t next;    // freelist
             DiskLoc_T where;
             T data;
+            bool used;
             bool dirty_page_bit;
-            Block() : next(LIST_END), prev(LIST_END),dirty_page_bit(false) {}
+            bool hot;
+            size_t pin;     // blocks in use by a caller are never evicted
+            Block() : next(LIST_END), used(false), dirty_page_bit(false), hot(false), pin(0) {}
         };
 
         size_t count;
         Block* pool;
-        ds::unordered_map<DiskLoc_T, size_t> table;
+        std::unordered_map<DiskLoc_T, size_t> table;
+        std::unique_ptr<ReplacementPolicy<DiskLoc_T>> policy;
 
         size_t freelist_head;
+        size_t hot_count;
+        size_t dirty_count;
+        size_t dirty_high_water;
+        std::function<void()> f_high_water;
+        std::mutex lock;
+        // get() waits here while every block is pinned, a slot being unpinned or freed wakes it
+        std::condition_variable released;
+        size_t waiting;
 
         func_load_t<DiskLoc_T,T> f_load;
         func_expire_t<DiskLoc_T,T> f_expire;
-    public:
-        LRUCache(size_t block_count, func_load_t<DiskLoc_T,T> load_func, func_expire_t<DiskLoc_T,T> expire_func)
-                : count(block_count), freelist_head(1), f_load(load_func), f_expire(expire_func) {
-            pool = new Block[count+1];
-            for (int i=1; i <count; ++i)
-                pool[i].next = i+1;
-            pool[count].next = LIST_END;
-            pool[LIST_END].next=pool[LIST_END].prev=LIST_END;
+        func_hot_t<T> f_hot;
+        analysis::Counters* counters;
+
+        void note(analysis::counter_t c) {
+            if (counters)counters->add(c);
         }
 
-        LRUCache(const LRUCache&) = delete;
+        size_t index_of(const T* data) const {
+            return ((const char*) data-(const char*) &pool[0].data)/sizeof(Block);
+        }
 
-        LRUCache& operator=(const LRUCache&) = delete;
+        void classify(size_t index) {
+            // hot blocks may take at most half of the cache
+            bool hot = f_hot && hot_count < count/2 && f_hot(&pool[index].data);
+            if (hot != pool[index].hot) {
+                pool[index].hot = hot;
+                hot ? ++hot_count : --hot_count;
+            }
+        }
 
-        bool remove(DiskLoc_T offset) {
+        bool remove_unlocked(DiskLoc_T offset, bool write_back = true) {
             auto iter = table.find(offset);
             if (iter == table.end())return false;
-            auto& block = pool[iter->second];
-            pool[block.prev].next = block.next;
-            pool[block.next].prev = block.prev;
+            size_t index = iter->second;
+            auto& block = pool[index];
+            policy->erase(index);
             block.next = freelist_head;
-            freelist_head = iter->second;
-            if(pool[iter->second].dirty_page_bit) {
-//                __Counter.dirty();
-                f_expire(block.where, &block.data);
+            block.pin = 0;
+            block.used = false;
+            if (block.hot) {
+                block.hot = false;
+                --hot_count;
+            }
+            freelist_head = index;
+            if(block.dirty_page_bit) {
+                --dirty_count;
+                if (write_back)f_expire(block.where, &block.data);
             }
             table.erase(offset);
+            if (waiting)released.notify_all();
             return true;
         }
 
-        DataPtr get(DiskLoc_T offset) {
-            auto iter = table.find(offset);
-            if (iter != table.end()) {
-                // cache hit
-//                __Counter.hit();
-                if (iter->second == pool[LIST_END].next) {
-                    return &pool[pool[LIST_END].next].data;
+        // free a slot for a miss, @return false if every block is pinned
+        bool evict() {
+            size_t victim = policy->victim([this](size_t i) { return !pool[i].pin && !pool[i].hot; });
+            if (!victim)
+                victim = policy->victim([this](size_t i) { return !pool[i].pin; });
+            if (!victim)return false;
+            note(analysis::CACHE_EVICT);
+            if (pool[victim].dirty_page_bit)note(analysis::CACHE_WRITEBACK);
+            if(!remove_unlocked(pool[victim].where))
+                throw std::logic_error("Cache:remove failed");
+            return true;
+        }
+
+    public:
+        BlockCache(size_t block_count, func_load_t<DiskLoc_T,T> load_func, func_expire_t<DiskLoc_T,T> expire_func,
+                   policy_t policy_type = LRU, func_hot_t<T> hot_func = nullptr)
+                : count(block_count), policy(make_policy<DiskLoc_T>(policy_type, block_count)),
+                  freelist_head(1), hot_count(0), dirty_count(0), dirty_high_water(SIZE_MAX), waiting(0),
+                  f_load(load_func), f_expire(expire_func), f_hot(hot_func), counters(nullptr) {
+            pool = new Block[count+1];
+            for (size_t i=1; i <count; ++i)
+                pool[i].next = i+1;
+            pool[count].next = LIST_END;
+        }
+
+        BlockCache(const BlockCache&) = delete;
+
+        BlockCache& operator=(const BlockCache&) = delete;
+
+        bool remove(DiskLoc_T offset) {
+            std::lock_guard<std::mutex> guard(lock);
+            return remove_unlocked(offset);
+        }
+
+        /*
+         * discard: drop offset without writing it back, for blocks cut off the file
+         */
+        bool discard(DiskLoc_T offset) {
+            std::lock_guard<std::mutex> guard(lock);
+            return remove_unlocked(offset, false);
+        }
+
+        bool contains(DiskLoc_T offset) {
+            std::lock_guard<std::mutex> guard(lock);
+            return table.find(offset) != table.end();
+        }
+
+        // hits, misses and evictions are counted into c from now on
+        void set_counters(analysis::Counters* c) {
+            std::lock_guard<std::mutex> guard(lock);
+            counters = c;
+        }
+
+        /*
+         * set_high_water: call notify, under the cache lock, whenever more than high_water blocks are dirty
+         */
+        void set_high_water(size_t high_water, std::function<void()> notify) {
+            std::lock_guard<std::mutex> guard(lock);
+            dirty_high_water = high_water;
+            f_high_water = std::move(notify);
+        }
+
+        /*
+         * write_back_cold: write back dirty blocks from the cold end, so that the next clean_target victims
+         * are clean and at most high_water blocks stay dirty. Blocks stay cached. @return blocks written
+         */
+        size_t write_back_cold(size_t clean_target, size_t high_water) {
+            std::lock_guard<std::mutex> guard(lock);
+            size_t seen = 0, written = 0;
+            policy->walk_cold([&](size_t index) {
+                auto& block = pool[index];
+                // pinned blocks may be under modification
+                if (block.pin || block.hot)return true;
+                if (seen >= clean_target && dirty_count <= high_water)return false;
+                ++seen;
+                if (block.dirty_page_bit) {
+                    f_expire(block.where, &block.data);
+                    block.dirty_page_bit = false;
+                    --dirty_count;
+                    ++written;
                 }
-                auto& block = pool[iter->second];
-                // remove from the ring
-                pool[block.prev].next = block.next;
-                pool[block.next].prev = block.prev;
-                // insert
-                block.next = pool[LIST_END].next;
-                block.prev = LIST_END;
-                pool[LIST_END].next = iter->second;
-                pool[block.next].prev = iter->second;
-                return &block.data;
+                return true;
+            });
+            return written;
+        }
+
+        /*
+         * get: the returned block is pinned until unpin() is called with it.
+         * slot, from slot_of(), is where offset was seen last: if it still holds offset the table isn't probed
+         * A miss while every block is pinned waits for concurrent users to unpin one. If none does within
+         * PIN_WAIT the cache is too small for the blocks its users hold at once, and logic_error is thrown.
+         */
+        DataPtr get(DiskLoc_T offset, size_t slot = 0) {
+            std::unique_lock<std::mutex> guard(lock);
+            bool timed_out = false;
+            for (;;) {
+                if (slot && slot <= count && pool[slot].used && pool[slot].where == offset) {
+                    note(analysis::CACHE_HIT);
+                    ++pool[slot].pin;
+                    policy->touch(slot);
+                    return &pool[slot].data;
+                }
+                auto iter = table.find(offset);
+                if (iter != table.end()) {
+                    // cache hit
+                    note(analysis::CACHE_HIT);
+                    ++pool[iter->second].pin;
+                    policy->touch(iter->second);
+                    return &pool[iter->second].data;
+                }
+                if (freelist_head != LIST_END || evict())break;
+                if (timed_out)
+                    throw std::logic_error("Cache: all blocks are pinned");
+                // another thread may load offset meanwhile, so look it up again
+                ++waiting;
+                timed_out = released.wait_for(guard, PIN_WAIT) == std::cv_status::timeout;
+                --waiting;
             }
             // cache miss
-//            __Counter.miss();
-            if (freelist_head == LIST_END)
-                if(!remove(pool[pool[LIST_END].prev].where))
-                    throw std::logic_error("Cache:remove failed");
-            auto tmp=pool[freelist_head].next;
-            /*
-             * set block the head
-             * pool[freelist_head] will be assigned
-             */
-            pool[pool[LIST_END].next].prev = freelist_head;
-            pool[freelist_head].prev = LIST_END;
-            pool[freelist_head].next = pool[LIST_END].next;
-            pool[LIST_END].next = freelist_head;
-            f_load(offset, &pool[freelist_head].data);
-            pool[freelist_head].dirty_page_bit= false;
-            pool[freelist_head].where=offset;
-            table[offset]=freelist_head;
-            // recover freelist_head
-            freelist_head=tmp;
-            return &pool[pool[LIST_END].next].data;
-        }
-
-        void dirty_bit_set(DiskLoc_T offset){ pool[table[offset]].dirty_page_bit= true;}
+            note(analysis::CACHE_MISS);
+            size_t index = freelist_head;
+            freelist_head = pool[index].next;
+            f_load(offset, &pool[index].data);
+            pool[index].used = true;
+            pool[index].dirty_page_bit= false;
+            pool[index].pin = 1;
+            pool[index].where=offset;
+            table[offset]=index;
+            classify(index);
+            policy->admit(index, offset);
+            return &pool[index].data;
+        }
+
+        // the slot of a block returned by get(), never 0
+        size_t slot_of(const T* data) const { return index_of(data); }
+
+        void unpin(const T* data) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!--pool[index_of(data)].pin && waiting)released.notify_all();
+        }
+
+        void dirty_bit_set(DiskLoc_T offset){
+            std::lock_guard<std::mutex> guard(lock);
+            size_t index = table[offset];
+            // once per crossing, the flusher brings the count back down
+            if (!pool[index].dirty_page_bit && ++dirty_count == dirty_high_water+1 && f_high_water)f_high_water();
+            pool[index].dirty_page_bit= true;
+            // e.g. a recycled block turned into an internal node
+            classify(index);
+        }
+        /*
+         * flush_all: write back every dirty block, blocks stay cached
+         */
+        void flush_all() {
+            std::lock_guard<std::mutex> guard(lock);
+            for (size_t index = 1; index <= count; ++index) {
+                if (pool[index].used && pool[index].dirty_page_bit) {
+                    f_expire(pool[index].where, &pool[index].data);
+                    pool[index].dirty_page_bit = false;
+                    --dirty_count;
+                }
+            }
+        }
+
         void destruct(){
-            for (size_t index = pool[LIST_END].next; index != LIST_END; index = pool[index].next) {
-                if(pool[index].dirty_page_bit)
+            for (size_t index = 1; index <= count; ++index) {
+                if(pool[index].used && pool[index].dirty_page_bit)
                     f_expire(pool[index].where,&pool[index].data);
             }
             delete[] pool;
             pool= nullptr;
         }
-        ~LRUCache() {
-            // user must call destruct() manually.
+        ~BlockCache() {
+            // user must call destruct() manually to write dirty blocks back, an owner that failed to open only frees them
+            delete[] pool;
+        }
+    };
+
+    /*
+     * Buffer pool split into independent BlockCache shards by a hash of the offset,
+     * each with its own lock, replacement state and pin counts, so that threads touching different blocks don't contend.
+     */
+    template <typename DiskLoc_T,typename T>
+    class ShardedCache {
+    private:
+        // smaller shards would run out of unpinned blocks under a few concurrent operations
+        const static size_t MIN_SHARD_BLOCKS = 64;
+
+        std::vector<std::unique_ptr<BlockCache<DiskLoc_T,T>>> shards;
+
+        size_t shard_blocks;
+        std::thread flusher;
+        std::mutex flusher_lock;
+        std::condition_variable flusher_wake;
+        bool flusher_stop;
+        bool flusher_kick;
+
+        void flusher_loop(size_t clean_target, size_t high_water, std::chrono::milliseconds interval) {
+            std::unique_lock<std::mutex> guard(flusher_lock);
+            while (!flusher_stop) {
+                flusher_wake.wait_for(guard, interval, [this] { return flusher_stop || flusher_kick; });
+                if (flusher_stop)break;
+                flusher_kick = false;
+                guard.unlock();
+                for (auto& s : shards) {
+                    // a failed write leaves its block dirty, eviction or the next checkpoint reports the error
+                    try { s->write_back_cold(clean_target, high_water); } catch (...) {}
+                }
+                guard.lock();
+            }
+        }
+
+        BlockCache<DiskLoc_T,T>& shard(DiskLoc_T offset) {
+            // fibonacci hashing, offsets are multiples of the block size
+            return *shards[(offset*0x9E3779B97F4A7C15ull >> 32) % shards.size()];
+        }
+    public:
+        ShardedCache(size_t block_count, size_t shard_count, func_load_t<DiskLoc_T,T> load_func, func_expire_t<DiskLoc_T,T> expire_func,
+                     policy_t policy = LRU, func_hot_t<T> hot_func = nullptr) : flusher_stop(false), flusher_kick(false) {
+            shard_count = std::max<size_t>(1, std::min(shard_count, block_count/MIN_SHARD_BLOCKS));
+            shard_blocks = block_count/shard_count;
+            for (size_t i = 0; i < shard_count; ++i)
+                shards.emplace_back(new BlockCache<DiskLoc_T,T>(shard_blocks, load_func, expire_func, policy, hot_func));
+        }
+
+        ShardedCache(const ShardedCache&) = delete;
+
+        ShardedCache& operator=(const ShardedCache&) = delete;
+
+        ~ShardedCache() { stop_flusher(); }
+
+        bool remove(DiskLoc_T offset) { return shard(offset).remove(offset); }
+
+        bool discard(DiskLoc_T offset) { return shard(offset).discard(offset); }
+
+        bool contains(DiskLoc_T offset) { return shard(offset).contains(offset); }
+
+        void set_counters(analysis::Counters* c) {
+            for (auto& s : shards)s->set_counters(c);
+        }
+
+        /*
+         * get: the returned block is pinned until unpin() is called with the same offset
+         */
+        T* get(DiskLoc_T offset, size_t slot = 0) { return shard(offset).get(offset, slot); }
+
+        size_t slot_of(DiskLoc_T offset, const T* data) { return shard(offset).slot_of(data); }
+
+        void unpin(DiskLoc_T offset, const T* data) { shard(offset).unpin(data); }
+
+        void dirty_bit_set(DiskLoc_T offset) { shard(offset).dirty_bit_set(offset); }
+
+        void flush_all() {
+            for (auto& s : shards)s->flush_all();
+        }
+
+        /*
+         * start_flusher: a background thread writes back cold dirty blocks every interval, or as soon as
+         * a shard has more than dirty_ratio of its blocks dirty. It keeps the clean_target coldest
+         * unpinned blocks of each shard clean, so that eviction can just drop them.
+         */
+        void start_flusher(size_t clean_target, double dirty_ratio, std::chrono::milliseconds interval) {
+            if (flusher.joinable())return;
+            size_t high_water = (size_t) (dirty_ratio*(double) block_count());
+            for (auto& s : shards) {
+                s->set_high_water(high_water, [this] {
+                    std::lock_guard<std::mutex> guard(flusher_lock);
+                    flusher_kick = true;
+                    flusher_wake.notify_one();
+                });
+            }
+            flusher = std::thread([=] { flusher_loop(clean_target, high_water, interval); });
+        }
+
+        void stop_flusher() {
+            if (!flusher.joinable())return;
+            {
+                std::lock_guard<std::mutex> guard(flusher_lock);
+                flusher_stop = true;
+            }
+            flusher_wake.notify_one();
+            flusher.join();
+        }
+
+        // blocks per shard
+        size_t block_count() const { return shard_blocks; }
+
+        void destruct() {
+            stop_flusher();
+            for (auto& s : shards)s->destruct();
         }
     };
 }
@@ -0,0 +1,254 @@
+#ifndef BPTREE_CODEC_H
+#define BPTREE_CODEC_H
+
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <type_traits>
+#include "bptree.h"
+
+namespace bptree {
+    /*
+     * On-disk node formats, chosen per tree file.
+     * CODEC_RAW is the writeBuffer image, a whole block.
+     * CODEC_DELTA stores integer keys as varint deltas from the previous key, integer values and child offsets
+     * as varints above the smallest of the node (frame of reference), other keys and values packed as they are.
+     * Its image only takes the bytes it needs, so loads and flushes skip the pages of the block behind it.
+     */
+    typedef enum {
+        CODEC_RAW, CODEC_DELTA
+    } codec_t;
+
+    namespace codec {
+        // tag = node type | format << 8, then the image length
+        const size_t TAG_SIZE = sizeof(int32_t)+sizeof(uint32_t);
+        enum {
+            DELTA = 1, PACKED = 2      // PACKED: raw entries, for nodes that varints would grow
+        };
+
+        inline char* put_varint(char* buf, uint64_t v) {
+            while (v >= 0x80) {
+                *buf++ = (char) (v | 0x80);
+                v >>= 7;
+            }
+            *buf++ = (char) v;
+            return buf;
+        }
+
+        inline const char* get_varint(const char* buf, uint64_t& v) {
+            v = 0;
+            for (int shift = 0;; shift += 7) {
+                auto byte = (uint8_t) *buf++;
+                v |= uint64_t(byte & 0x7f) << shift;
+                if (!(byte & 0x80))return buf;
+            }
+        }
+
+        inline uint64_t zigzag(uint64_t v) { return (v << 1) ^ (uint64_t) ((int64_t) v >> 63); }
+
+        inline uint64_t unzigzag(uint64_t v) { return (v >> 1) ^ (0-(v & 1)); }
+
+        template<typename T>
+        struct is_packable {
+            static const bool value = std::is_integral<T>::value && sizeof(T) <= sizeof(uint64_t);
+        };
+
+        // sorted integers: the first one, then the gaps
+        template<typename T>
+        char* put_deltas(char* buf, const T* v, size_t n) {
+            uint64_t last = 0;
+            for (size_t i = 0; i < n; ++i) {
+                buf = put_varint(buf, zigzag((uint64_t) v[i]-last));
+                last = (uint64_t) v[i];
+            }
+            return buf;
+        }
+
+        template<typename T>
+        const char* get_deltas(const char* buf, T* v, size_t n) {
+            uint64_t last = 0, d;
+            for (size_t i = 0; i < n; ++i) {
+                buf = get_varint(buf, d);
+                last += unzigzag(d);
+                v[i] = (T) last;
+            }
+            return buf;
+        }
+
+        // integers in any order: the smallest, then the distance of each from it
+        template<typename T>
+        char* put_frame(char* buf, const T* v, size_t n, uint64_t scale = 1) {
+            T base = n ? *std::min_element(v, v+n) : T();
+            buf = put_varint(buf, zigzag((uint64_t) base));
+            for (size_t i = 0; i < n; ++i)buf = put_varint(buf, ((uint64_t) v[i]-(uint64_t) base)/scale);
+            return buf;
+        }
+
+        template<typename T>
+        const char* get_frame(const char* buf, T* v, size_t n, uint64_t scale = 1) {
+            uint64_t base, d;
+            buf = get_varint(buf, base);
+            base = unzigzag(base);
+            for (size_t i = 0; i < n; ++i) {
+                buf = get_varint(buf, d);
+                v[i] = (T) (base+d*scale);
+            }
+            return buf;
+        }
+
+        // keys the way writeBuffer lays them out, cut at size
+        template<typename KeyType>
+        char* put_keys(char* buf, const KeyType* keys, size_t n) {
+            if constexpr (key_traits<KeyType>::variable) return key_traits<KeyType>::encode(keys, n, buf);
+            memcpy(buf, (void*) keys, sizeof(KeyType)*n);
+            return buf+sizeof(KeyType)*n;
+        }
+
+        template<typename KeyType>
+        const char* get_keys(const char* buf, KeyType* keys, size_t n) {
+            if constexpr (key_traits<KeyType>::variable) return key_traits<KeyType>::decode(keys, n, buf);
+            memcpy((void*) keys, buf, sizeof(KeyType)*n);
+            return buf+sizeof(KeyType)*n;
+        }
+
+        template<typename KeyType, typename ValueType, size_t Degree>
+        char* put_entries(char* buf, const Node<KeyType, ValueType, Degree>* node) {
+            typedef Node<KeyType, ValueType, Degree> NodeT;
+            if constexpr (is_packable<KeyType>::value) buf = put_deltas(buf, node->K, node->size);
+            else buf = put_keys(buf, node->K, node->size);
+            if (node->type == NodeT::LEAF) {
+                if constexpr (is_packable<ValueType>::value) return put_frame(buf, node->V, node->size);
+                memcpy(buf, (void*) node->V, sizeof(ValueType)*node->size);
+                return buf+sizeof(ValueType)*node->size;
+            }
+            // children sit at multiples of the block size
+            DiskLoc_T children[Degree+1];
+            write_children(node, node->size+1, (char*) children);
+            uint64_t scale = NodeT::BLOCK_SIZE;
+            for (size_t i = 0; i <= node->size; ++i)
+                if (children[i]%scale)scale = 1;
+            buf = put_varint(buf, scale);
+            buf = put_frame(buf, children, node->size+1, scale);
+            if constexpr (ORDER_STATS) buf = put_frame(buf, node->counts, node->size+1);
+            return buf;
+        }
+
+        template<typename KeyType, typename ValueType, size_t Degree>
+        void get_entries(const char* buf, Node<KeyType, ValueType, Degree>* node) {
+            typedef Node<KeyType, ValueType, Degree> NodeT;
+            if constexpr (is_packable<KeyType>::value) buf = get_deltas(buf, node->K, node->size);
+            else buf = get_keys(buf, node->K, node->size);
+            if (node->type == NodeT::LEAF) {
+                if constexpr (is_packable<ValueType>::value) get_frame(buf, node->V, node->size);
+                else memcpy((void*) node->V, buf, sizeof(ValueType)*node->size);
+                return;
+            }
+            uint64_t scale;
+            buf = get_varint(buf, scale);
+            buf = get_frame(buf, node->sub_nodes, node->size+1, scale);
+            if constexpr (ORDER_STATS) get_frame(buf, node->counts, node->size+1);
+        }
+
+        // the widest a DELTA image of the node can get, so that encoding never runs past a block
+        template<typename KeyType, typename ValueType, size_t Degree>
+        size_t delta_bound(const Node<KeyType, ValueType, Degree>* node) {
+            const size_t VARINT = 10;
+            size_t keys;
+            if constexpr (key_traits<KeyType>::variable) keys = key_traits<KeyType>::encoded_size(node->K, node->size);
+            else keys = node->size*std::max(sizeof(KeyType), VARINT);
+            size_t entries = node->type == Node<KeyType, ValueType, Degree>::LEAF
+                             ? (node->size+1)*std::max(sizeof(ValueType), VARINT) : (node->size+3)*VARINT*(ORDER_STATS ? 2 : 1);
+            return TAG_SIZE+4*VARINT+keys+entries;
+        }
+    }
+
+    /*
+     * encodeNode: write the image of node to buf, a zeroed block. @return the image length
+     */
+    template<typename KeyType, typename ValueType, size_t Degree>
+    size_t encodeNode(codec_t c, const Node<KeyType, ValueType, Degree>* node, char* buf) {
+        typedef Node<KeyType, ValueType, Degree> NodeT;
+        if (c == CODEC_RAW) {
+            writeBuffer(node, buf);
+            return NodeT::BLOCK_SIZE;
+        }
+        char* p = buf+codec::TAG_SIZE;
+        int32_t format = codec::DELTA;
+        if (node->type == NodeT::FREE) {
+            p = codec::put_varint(p, node->next+1);
+        } else if (codec::delta_bound(node) <= NodeT::BLOCK_SIZE) {
+            p = codec::put_varint(p, node->next+1);
+            p = codec::put_varint(p, node->prev+1);
+            p = codec::put_varint(p, node->size);
+            p = codec::put_entries(p, node);
+        } else {
+            // the writeBuffer image without the offset, the slot's, which always fits
+#define write_attribute(ATTR) memcpy(p,(void*)&node->ATTR,sizeof(node->ATTR));p+=sizeof(node->ATTR)
+            format = codec::PACKED;
+            write_attribute(next);
+            write_attribute(prev);
+            write_attribute(size);
+#undef write_attribute
+            p = codec::put_keys(p, node->K, node->size);
+            if (node->type == NodeT::LEAF) {
+                memcpy(p, (void*) node->V, sizeof(ValueType)*node->size);
+                p += sizeof(ValueType)*node->size;
+            } else p = write_counts(node, node->size+1, write_children(node, node->size+1, p));
+        }
+        auto tag = (int32_t) (node->type | format << 8);
+        auto length = (uint32_t) (p-buf);
+        memcpy(buf, &tag, sizeof(tag));
+        memcpy(buf+sizeof(tag), &length, sizeof(length));
+        return length;
+    }
+
+    /*
+     * imageLength: the length of the image at buf, known from its first TAG_SIZE bytes
+     */
+    template<typename KeyType, typename ValueType, size_t Degree>
+    size_t imageLength(codec_t c, const char* buf) {
+        if (c == CODEC_RAW)return Node<KeyType, ValueType, Degree>::BLOCK_SIZE;
+        uint32_t length;
+        memcpy(&length, buf+sizeof(int32_t), sizeof(length));
+        // a slot that was never written reads as zeroes
+        return std::max<size_t>(length, codec::TAG_SIZE);
+    }
+
+    template<typename KeyType, typename ValueType, size_t Degree>
+    void decodeNode(codec_t c, Node<KeyType, ValueType, Degree>* node, DiskLoc_T offset, char* buf) {
+        typedef Node<KeyType, ValueType, Degree> NodeT;
+        if (c == CODEC_RAW) {
+            readBuffer(node, buf);
+            return;
+        }
+        int32_t tag;
+        memcpy(&tag, buf, sizeof(tag));
+        const char* p = buf+codec::TAG_SIZE;
+        uint64_t v;
+        node->type = (typename NodeT::type_t) (tag & 0xff);
+        node->offset = offset;
+        if ((tag >> 8) == codec::PACKED) {
+#define read_attribute(ATTR) memcpy((void*)&node->ATTR,p,sizeof(node->ATTR));p+=sizeof(node->ATTR)
+            read_attribute(next);
+            read_attribute(prev);
+            read_attribute(size);
+#undef read_attribute
+            p = codec::get_keys(p, node->K, node->size);
+            if (node->type == NodeT::LEAF)memcpy((void*) node->V, p, sizeof(ValueType)*node->size);
+            else {
+                memcpy((void*) node->sub_nodes, p, sizeof(DiskLoc_T)*(node->size+1));
+                read_counts(node, node->size+1, p+sizeof(DiskLoc_T)*(node->size+1));
+            }
+            return;
+        }
+        p = codec::get_varint(p, v);
+        node->next = v-1;
+        if (node->type == NodeT::FREE)return;
+        p = codec::get_varint(p, v);
+        node->prev = v-1;
+        p = codec::get_varint(p, v);
+        node->size = v;
+        codec::get_entries(p, node);
+    }
+}
+#endif //BPTREE_CODEC_H
@@ -0,0 +1,475 @@
+#ifndef BPTREE_IO_H
+#define BPTREE_IO_H
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+#include <functional>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define BPTREE_HAS_IO_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+// pulled in through <linux/fs.h>, collides with Node::BLOCK_SIZE
+#undef BLOCK_SIZE
+#endif
+
+namespace io {
+    typedef enum {
+        IO_THREADS, IO_URING
+    } engine_t;
+
+    // offset -> page image
+    typedef std::map<uint64_t, std::vector<char>> Batch;
+
+    /*
+     * How batches of writes and read-ahead hints reach the disk.
+     */
+    class Backend {
+    public:
+        virtual ~Backend() = default;
+
+        // issue every write of the batch at once, returns when all of them are done
+        virtual void write_batch(int fd, const Batch& batch) = 0;
+
+        // start reading [offset, offset+len) into the page cache without waiting for it, may be dropped
+        virtual void prefetch(int fd, uint64_t offset, size_t len) = 0;
+    };
+
+    inline void pwrite_all(int fd, const char* buf, size_t len, uint64_t offset) {
+        while (len) {
+            ssize_t n = ::pwrite(fd, buf, len, offset);
+            if (n <= 0)throw std::runtime_error("IO: write failure");
+            buf += n;
+            len -= n;
+            offset += n;
+        }
+    }
+
+    class ThreadPoolBackend : public Backend {
+    private:
+        // read-ahead hints queued beyond this are dropped
+        const static size_t MAX_QUEUED = 256;
+
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> tasks;
+        std::mutex lock;
+        std::condition_variable wake;
+        bool stop;
+
+        void run() {
+            for (;;) {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    wake.wait(guard, [this] { return stop || !tasks.empty(); });
+                    if (tasks.empty())return;
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                task();
+            }
+        }
+
+    public:
+        explicit ThreadPoolBackend(size_t threads) : stop(false) {
+            for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i)
+                workers.emplace_back([this] { run(); });
+        }
+
+        ~ThreadPoolBackend() override {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stop = true;
+            }
+            wake.notify_all();
+            for (auto& w : workers)w.join();
+        }
+
+        void write_batch(int fd, const Batch& batch) override {
+            std::mutex done_lock;
+            std::condition_variable done;
+            size_t left = batch.size();
+            std::exception_ptr error;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                for (auto& page : batch) {
+                    tasks.emplace_back([&, fd] {
+                        std::exception_ptr e;
+                        try { pwrite_all(fd, page.second.data(), page.second.size(), page.first); }
+                        catch (...) { e = std::current_exception(); }
+                        std::lock_guard<std::mutex> g(done_lock);
+                        if (e && !error)error = e;
+                        if (!--left)done.notify_one();
+                    });
+                }
+            }
+            wake.notify_all();
+            std::unique_lock<std::mutex> guard(done_lock);
+            done.wait(guard, [&] { return !left; });
+            if (error)std::rethrow_exception(error);
+        }
+
+        void prefetch(int fd, uint64_t offset, size_t len) override {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (tasks.size() >= MAX_QUEUED)return;
+                tasks.emplace_back([fd, offset, len] { ::readahead(fd, offset, len); });
+            }
+            wake.notify_one();
+        }
+    };
+
+#ifdef BPTREE_HAS_IO_URING
+    /*
+     * io_uring through the raw system calls, one ring shared under a lock.
+     * Writes of a batch are queued together and submitted with a single io_uring_enter,
+     * read-ahead is an asynchronous IORING_OP_FADVISE whose completion is reaped later.
+     */
+    class UringBackend : public Backend {
+    private:
+        // writes carry their length in user_data to detect short writes
+        const static uint64_t PREFETCH_TAG = 0;
+
+        int ring_fd;
+        unsigned entries;
+        unsigned in_flight;
+        void* sq_ring;
+        void* cq_ring;
+        size_t sq_ring_len, cq_ring_len;
+        io_uring_sqe* sqes;
+        unsigned* sq_head, * sq_tail, * sq_mask, * sq_array;
+        unsigned* cq_head, * cq_tail, * cq_mask;
+        io_uring_cqe* cqes;
+        std::mutex lock;
+
+        int enter(unsigned submit, unsigned wait) {
+            for (;;) {
+                int r = (int) ::syscall(__NR_io_uring_enter, ring_fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                                        nullptr, 0);
+                if (r >= 0 || errno != EINTR)return r;
+            }
+        }
+
+        // the caller fills the entry, then publishes it with push()
+        io_uring_sqe* next_sqe() {
+            unsigned tail = *sq_tail;
+            io_uring_sqe* sqe = &sqes[tail & *sq_mask];
+            memset(sqe, 0, sizeof(*sqe));
+            sq_array[tail & *sq_mask] = tail & *sq_mask;
+            return sqe;
+        }
+
+        void push() {
+            __atomic_store_n(sq_tail, *sq_tail+1, __ATOMIC_RELEASE);
+            ++in_flight;
+        }
+
+        template<typename Func>
+        void reap(Func on_complete) {
+            unsigned head = *cq_head;
+            for (; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); ++head, --in_flight)
+                on_complete(cqes[head & *cq_mask]);
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+
+    public:
+        explicit UringBackend(unsigned depth) : in_flight(0), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED) {
+            io_uring_params params{};
+            ring_fd = (int) ::syscall(__NR_io_uring_setup, depth, &params);
+            if (ring_fd < 0)throw std::runtime_error("IO: io_uring unavailable");
+            entries = params.sq_entries;
+            sq_ring_len = params.sq_off.array+params.sq_entries*sizeof(unsigned);
+            cq_ring_len = params.cq_off.cqes+params.cq_entries*sizeof(io_uring_cqe);
+            bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single)sq_ring_len = cq_ring_len = std::max(sq_ring_len, cq_ring_len);
+            sq_ring = ::mmap(nullptr, sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+            cq_ring = single ? sq_ring : ::mmap(nullptr, cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                ring_fd, IORING_OFF_CQ_RING);
+            void* s = ::mmap(nullptr, params.sq_entries*sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+            if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || s == MAP_FAILED) {
+                if (s != MAP_FAILED)::munmap(s, params.sq_entries*sizeof(io_uring_sqe));
+                if (cq_ring != MAP_FAILED && cq_ring != sq_ring)::munmap(cq_ring, cq_ring_len);
+                if (sq_ring != MAP_FAILED)::munmap(sq_ring, sq_ring_len);
+                ::close(ring_fd);
+                throw std::runtime_error("IO: can't map io_uring");
+            }
+            sqes = static_cast<io_uring_sqe*>(s);
+            char* sq = static_cast<char*>(sq_ring);
+            char* cq = static_cast<char*>(cq_ring);
+            sq_head = (unsigned*) (sq+params.sq_off.head);
+            sq_tail = (unsigned*) (sq+params.sq_off.tail);
+            sq_mask = (unsigned*) (sq+params.sq_off.ring_mask);
+            sq_array = (unsigned*) (sq+params.sq_off.array);
+            cq_head = (unsigned*) (cq+params.cq_off.head);
+            cq_tail = (unsigned*) (cq+params.cq_off.tail);
+            cq_mask = (unsigned*) (cq+params.cq_off.ring_mask);
+            cqes = (io_uring_cqe*) (cq+params.cq_off.cqes);
+        }
+
+        ~UringBackend() override {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                while (in_flight && enter(0, 1) >= 0)reap([](const io_uring_cqe&) {});
+            }
+            ::munmap(sqes, entries*sizeof(io_uring_sqe));
+            if (cq_ring != sq_ring)::munmap(cq_ring, cq_ring_len);
+            ::munmap(sq_ring, sq_ring_len);
+            ::close(ring_fd);
+        }
+
+        void write_batch(int fd, const Batch& batch) override {
+            std::lock_guard<std::mutex> guard(lock);
+            size_t left = batch.size();
+            bool failed = false;
+            auto on_complete = [&](const io_uring_cqe& cqe) {
+                if (cqe.user_data == PREFETCH_TAG)return;
+                --left;
+                if (cqe.res != (int) cqe.user_data)failed = true;
+            };
+            auto page = batch.begin();
+            while (left) {
+                unsigned queued = 0;
+                // in_flight stays within the submission ring, so the completion ring can't overflow
+                for (; page != batch.end() && in_flight < entries; ++page, ++queued) {
+                    io_uring_sqe* sqe = next_sqe();
+                    sqe->opcode = IORING_OP_WRITE;
+                    sqe->fd = fd;
+                    sqe->off = page->first;
+                    sqe->addr = (uint64_t) page->second.data();
+                    sqe->len = page->second.size();
+                    sqe->user_data = page->second.size();
+                    push();
+                }
+                if (enter(queued, 1) < 0)throw std::runtime_error("IO: io_uring_enter failure");
+                reap(on_complete);
+            }
+            if (failed)throw std::runtime_error("IO: write failure");
+        }
+
+        void prefetch(int fd, uint64_t offset, size_t len) override {
+            // a hint, not worth waiting on writes for
+            std::unique_lock<std::mutex> guard(lock, std::try_to_lock);
+            if (!guard.owns_lock())return;
+            reap([](const io_uring_cqe&) {});
+            if (in_flight >= entries)return;
+            io_uring_sqe* sqe = next_sqe();
+            sqe->opcode = IORING_OP_FADVISE;
+            sqe->fd = fd;
+            sqe->off = offset;
+            sqe->len = len;
+            sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+            sqe->user_data = PREFETCH_TAG;
+            push();
+            enter(1, 0);
+        }
+    };
+#endif
+
+    /*
+     * Positional I/O on one file, safe to use from several threads.
+     * read() and write() block, write_async() copies the page and returns: pages are collected into batches
+     * that a writer thread hands to the backend while the next batch fills. Reads see queued writes.
+     * write_async() only waits for the writer once MAX_QUEUED batches are waiting, so callers may hold locks.
+     */
+    class File {
+    private:
+        // adjacent pages are merged into writes of up to this many bytes
+        static const size_t MAX_RUN = 1 << 20;
+        // batches that may pile up behind the writer before write_async() waits for it
+        static const size_t MAX_QUEUED = 8;
+
+        int fd;
+        size_t batch_pages;
+        std::unique_ptr<Backend> backend;
+
+        Batch pending;      // newest images, not handed to the backend yet
+        Batch writing;      // owned by the writer thread while busy
+        bool busy;
+        bool stop;
+        std::exception_ptr error;
+        std::function<void()> before_write;
+        std::mutex lock;
+        std::condition_variable wake, idle;
+        std::thread writer;
+
+        void run() {
+            std::unique_lock<std::mutex> guard(lock);
+            for (;;) {
+                wake.wait(guard, [this] { return stop || busy; });
+                if (!busy)return;
+                guard.unlock();
+                std::exception_ptr e;
+                try {
+                    if (before_write)before_write();
+                    backend->write_batch(fd, coalesce(writing));
+                }
+                catch (...) { e = std::current_exception(); }
+                guard.lock();
+                if (e && !error)error = e;
+                writing.clear();
+                // a full batch that queued up meanwhile goes out right away
+                if (pending.size() >= batch_pages) {
+                    writing.swap(pending);
+                    continue;
+                }
+                busy = false;
+                idle.notify_all();
+            }
+        }
+
+        static Batch coalesce(const Batch& batch) {
+            Batch runs;
+            auto run = runs.end();
+            for (auto& page : batch) {
+                if (run != runs.end() && run->first+run->second.size() == page.first
+                    && run->second.size()+page.second.size() <= MAX_RUN)
+                    run->second.insert(run->second.end(), page.second.begin(), page.second.end());
+                else run = runs.emplace_hint(runs.end(), page.first, page.second);
+            }
+            return runs;
+        }
+
+        // hand pending to the writer, waits for the previous batch first
+        void submit(std::unique_lock<std::mutex>& guard) {
+            idle.wait(guard, [this] { return !busy; });
+            if (pending.empty())return;
+            writing.swap(pending);
+            busy = true;
+            wake.notify_one();
+        }
+
+        // rethrow a failure of the writer thread, lock held
+        void check() {
+            if (!error)return;
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+
+    public:
+        File(const std::string& path, engine_t engine = IO_URING, size_t threads = 4, size_t batch_pages = 32)
+                : batch_pages(std::max<size_t>(batch_pages, 1)), busy(false), stop(false) {
+            fd = ::open(path.c_str(), O_RDWR);
+            if (fd < 0)throw std::runtime_error("IO: can't open "+path);
+#ifdef BPTREE_HAS_IO_URING
+            if (engine == IO_URING) {
+                // containers often forbid io_uring, fall back to threads
+                try { backend.reset(new UringBackend(std::max<size_t>(64, this->batch_pages))); }
+                catch (const std::runtime_error&) {}
+            }
+#endif
+            if (!backend)backend.reset(new ThreadPoolBackend(threads));
+            writer = std::thread([this] { run(); });
+        }
+
+        File(const File&) = delete;
+
+        File& operator=(const File&) = delete;
+
+        ~File() {
+            try { drain(); } catch (...) {}
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stop = true;
+            }
+            wake.notify_one();
+            writer.join();
+            backend.reset();
+            ::close(fd);
+        }
+
+        void read(uint64_t offset, char* buf, size_t len) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                for (Batch* b : {&pending, &writing}) {
+                    auto iter = b->find(offset);
+                    if (iter != b->end() && iter->second.size() >= len) {
+                        memcpy(buf, iter->second.data(), len);
+                        return;
+                    }
+                }
+            }
+            while (len) {
+                ssize_t n = ::pread(fd, buf, len, offset);
+                if (n < 0)throw std::runtime_error("IO: read failure");
+                if (!n) {
+                    // past the end of the file
+                    memset(buf, 0, len);
+                    return;
+                }
+                buf += n;
+                len -= n;
+                offset += n;
+            }
+        }
+
+        void write(uint64_t offset, const char* buf, size_t len) {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                // an older queued image must not land after this one
+                pending.erase(offset);
+                if (writing.count(offset))idle.wait(guard, [this] { return !busy; });
+            }
+            pwrite_all(fd, buf, len, offset);
+        }
+
+        void write_async(uint64_t offset, const char* buf, size_t len) {
+            std::unique_lock<std::mutex> guard(lock);
+            check();
+            pending[offset].assign(buf, buf+len);
+            // while the writer is busy the batch grows, it takes the whole of it next
+            if (pending.size() >= batch_pages && (!busy || pending.size() >= MAX_QUEUED*batch_pages))submit(guard);
+        }
+
+        /*
+         * set_before_write: fn runs on the writer thread before each batch reaches the file,
+         * e.g. to sync a log that has to be ahead of the file. A throw fails the batch like a write error.
+         * Set it before the first write_async().
+         */
+        void set_before_write(std::function<void()> fn) {
+            std::lock_guard<std::mutex> guard(lock);
+            before_write = std::move(fn);
+        }
+
+        void prefetch(uint64_t offset, size_t len) { backend->prefetch(fd, offset, len); }
+
+        /*
+         * drain: wait until every queued write reached the file
+         */
+        void drain() {
+            std::unique_lock<std::mutex> guard(lock);
+            submit(guard);
+            idle.wait(guard, [this] { return !busy; });
+            check();
+        }
+
+        void sync() {
+            drain();
+            if (::fdatasync(fd))throw std::runtime_error("IO: sync failure");
+        }
+
+        /*
+         * truncate: cut the file to size bytes once the queued writes are in
+         */
+        void truncate(uint64_t size) {
+            drain();
+            if (::ftruncate(fd, size))throw std::runtime_error("IO: truncate failure");
+        }
+    };
+}
+#endif //BPTREE_IO_H
@@ -0,0 +1,131 @@
+#ifndef BPTREE_KEY_H
+#define BPTREE_KEY_H
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <stdexcept>
+
+namespace bptree {
+    /*
+     * VarKey: a byte string of at most N bytes, ordered like std::string.
+     * The bytes are kept inline so nodes stay copyable without destructor, on disk only the used bytes are stored.
+     */
+    template<size_t N>
+    struct VarKey {
+        static_assert(N > 0 && N < 256, "VarKey: the length must fit in a byte");
+        uint8_t len;
+        char data[N];
+
+        VarKey() = default;
+
+        VarKey(const char* s, size_t n) : len((uint8_t) n) {
+            if (n > N)throw std::length_error("VarKey: key longer than "+std::to_string(N)+" bytes");
+            memcpy(data, s, n);
+        }
+
+        VarKey(const std::string& s) : VarKey(s.data(), s.size()) {}
+
+        VarKey(const char* s) : VarKey(s, strlen(s)) {}
+
+        size_t size() const { return len; }
+
+        std::string str() const { return std::string(data, len); }
+
+        friend bool operator<(const VarKey& a, const VarKey& b) {
+            int c = memcmp(a.data, b.data, std::min(a.len, b.len));
+            return c < 0 || (!c && a.len < b.len);
+        }
+
+        friend bool operator>(const VarKey& a, const VarKey& b) { return b < a; }
+
+        friend bool operator==(const VarKey& a, const VarKey& b) {
+            return a.len == b.len && !memcmp(a.data, b.data, a.len);
+        }
+
+        friend bool operator!=(const VarKey& a, const VarKey& b) { return !(a == b); }
+    };
+
+    /*
+     * key_traits: how a node stores its keys.
+     * Fixed size keys are copied as they are and the separator of two nodes is the first key of the right one.
+     */
+    template<typename KeyType>
+    struct key_traits {
+        static const bool variable = false;
+        static const size_t MAX_BYTES = sizeof(KeyType);
+
+        static const KeyType& separator(const KeyType&, const KeyType& right) { return right; }
+    };
+
+    /*
+     * Nodes of VarKeys are prefix compressed: the prefix shared by all keys of a node is stored once,
+     * then every key as a length byte and its remaining bytes.
+     */
+    template<size_t N>
+    struct key_traits<VarKey<N>> {
+        typedef VarKey<N> Key;
+        static const bool variable = true;
+        // a key with its length byte
+        static const size_t MAX_BYTES = N+1;
+
+        static size_t common_prefix(const Key& a, const Key& b) {
+            size_t n = std::min(a.len, b.len), i = 0;
+            while (i < n && a.data[i] == b.data[i])++i;
+            return i;
+        }
+
+        // keys[0, n) are sorted, so what the first and the last share, all of them share
+        static size_t common_prefix(const Key* keys, size_t n) {
+            return n ? common_prefix(keys[0], keys[n-1]) : 0;
+        }
+
+        /*
+         * separator: the shortest prefix of right that still sorts above left,
+         * pushed to the parent instead of the whole first key of the right node
+         */
+        static Key separator(const Key& left, const Key& right) {
+            size_t prefix = common_prefix(left, right);
+            return prefix < right.len ? Key(right.data, prefix+1) : right;
+        }
+
+        // bytes of keys[0, n) once encoded, see encode()
+        static size_t encoded_size(const Key* keys, size_t n) {
+            size_t prefix = common_prefix(keys, n), bytes = 1+prefix;
+            for (size_t i = 0; i < n; ++i)bytes += 1+keys[i].len-prefix;
+            return bytes;
+        }
+
+        static char* encode(const Key* keys, size_t n, char* buf) {
+            auto prefix = (uint8_t) common_prefix(keys, n);
+            *buf++ = (char) prefix;
+            if (n)memcpy(buf, keys[0].data, prefix);
+            buf += prefix;
+            for (size_t i = 0; i < n; ++i) {
+                *buf++ = (char) (keys[i].len-prefix);
+                memcpy(buf, keys[i].data+prefix, keys[i].len-prefix);
+                buf += keys[i].len-prefix;
+            }
+            return buf;
+        }
+
+        static const char* decode(Key* keys, size_t n, const char* buf) {
+            auto prefix = (uint8_t) *buf++;
+            // whole key copies have a fixed size, cheaper than a short copy of the prefix each
+            Key shared;
+            memcpy(shared.data, buf, prefix);
+            buf += prefix;
+            for (size_t i = 0; i < n; ++i) {
+                auto suffix = (uint8_t) *buf++;
+                keys[i] = shared;
+                keys[i].len = prefix+suffix;
+                memcpy(keys[i].data+prefix, buf, suffix);
+                buf += suffix;
+            }
+            return buf;
+        }
+    };
+}
+#endif //BPTREE_KEY_H
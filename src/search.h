@@ -0,0 +1,179 @@
+#ifndef BPTREE_SEARCH_H
+#define BPTREE_SEARCH_H
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+namespace bptree {
+    /*
+     * count_keys: number of keys in [keys, keys+n) that are less than key, or greater with Greater.
+     * 32/64-bit integers and floating keys are compared a vector at a time when the target has AVX2 or SSE4.2.
+     */
+    template<bool Greater, typename KeyType>
+    inline size_t count_keys(const KeyType* keys, size_t n, KeyType key) {
+        size_t i = 0, count = 0;
+#if defined(__AVX2__)
+        if constexpr (std::is_integral<KeyType>::value && sizeof(KeyType) == 8) {
+            // signed compare only, flip the sign bit of unsigned keys
+            const __m256i bias = _mm256_set1_epi64x(std::is_signed<KeyType>::value ? 0 : INT64_MIN);
+            const __m256i k = _mm256_xor_si256(_mm256_set1_epi64x((int64_t) key), bias);
+            for (; i+4 <= n; i += 4) {
+                __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (keys+i)), bias);
+                __m256i m = Greater ? _mm256_cmpgt_epi64(x, k) : _mm256_cmpgt_epi64(k, x);
+                count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(m)));
+            }
+        } else if constexpr (std::is_integral<KeyType>::value && sizeof(KeyType) == 4) {
+            const __m256i bias = _mm256_set1_epi32(std::is_signed<KeyType>::value ? 0 : INT32_MIN);
+            const __m256i k = _mm256_xor_si256(_mm256_set1_epi32((int32_t) key), bias);
+            for (; i+8 <= n; i += 8) {
+                __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (keys+i)), bias);
+                __m256i m = Greater ? _mm256_cmpgt_epi32(x, k) : _mm256_cmpgt_epi32(k, x);
+                count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(m)));
+            }
+        } else if constexpr (std::is_same<KeyType, double>::value) {
+            const __m256d k = _mm256_set1_pd(key);
+            for (; i+4 <= n; i += 4) {
+                __m256d x = _mm256_loadu_pd(keys+i);
+                __m256d m = Greater ? _mm256_cmp_pd(x, k, _CMP_GT_OQ) : _mm256_cmp_pd(x, k, _CMP_LT_OQ);
+                count += __builtin_popcount(_mm256_movemask_pd(m));
+            }
+        } else if constexpr (std::is_same<KeyType, float>::value) {
+            const __m256 k = _mm256_set1_ps(key);
+            for (; i+8 <= n; i += 8) {
+                __m256 x = _mm256_loadu_ps(keys+i);
+                __m256 m = Greater ? _mm256_cmp_ps(x, k, _CMP_GT_OQ) : _mm256_cmp_ps(x, k, _CMP_LT_OQ);
+                count += __builtin_popcount(_mm256_movemask_ps(m));
+            }
+        }
+#elif defined(__SSE4_2__)
+        if constexpr (std::is_integral<KeyType>::value && sizeof(KeyType) == 8) {
+            const __m128i bias = _mm_set1_epi64x(std::is_signed<KeyType>::value ? 0 : INT64_MIN);
+            const __m128i k = _mm_xor_si128(_mm_set1_epi64x((int64_t) key), bias);
+            for (; i+2 <= n; i += 2) {
+                __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (keys+i)), bias);
+                __m128i m = Greater ? _mm_cmpgt_epi64(x, k) : _mm_cmpgt_epi64(k, x);
+                count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(m)));
+            }
+        } else if constexpr (std::is_integral<KeyType>::value && sizeof(KeyType) == 4) {
+            const __m128i bias = _mm_set1_epi32(std::is_signed<KeyType>::value ? 0 : INT32_MIN);
+            const __m128i k = _mm_xor_si128(_mm_set1_epi32((int32_t) key), bias);
+            for (; i+4 <= n; i += 4) {
+                __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (keys+i)), bias);
+                __m128i m = Greater ? _mm_cmpgt_epi32(x, k) : _mm_cmpgt_epi32(k, x);
+                count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(m)));
+            }
+        } else if constexpr (std::is_same<KeyType, double>::value) {
+            const __m128d k = _mm_set1_pd(key);
+            for (; i+2 <= n; i += 2) {
+                __m128d x = _mm_loadu_pd(keys+i);
+                count += __builtin_popcount(_mm_movemask_pd(Greater ? _mm_cmpgt_pd(x, k) : _mm_cmplt_pd(x, k)));
+            }
+        } else if constexpr (std::is_same<KeyType, float>::value) {
+            const __m128 k = _mm_set1_ps(key);
+            for (; i+4 <= n; i += 4) {
+                __m128 x = _mm_loadu_ps(keys+i);
+                count += __builtin_popcount(_mm_movemask_ps(Greater ? _mm_cmpgt_ps(x, k) : _mm_cmplt_ps(x, k)));
+            }
+        }
+#endif
+        for (; i < n; ++i)count += Greater ? key < keys[i] : keys[i] < key;
+        return count;
+    }
+
+    /*
+     * KeySearch: lower/upper bound of key in a sorted node, returned as an index.
+     * Arithmetic keys under std::less narrow the range with a branch-free bisection
+     * and count the last few cache lines with count_keys, everything else uses the standard algorithms.
+     */
+    template<typename KeyType, typename WeakCmp,
+            bool = std::is_arithmetic<KeyType>::value && std::is_same<WeakCmp, std::less<KeyType>>::value>
+    struct KeySearch {
+        static size_t lower(const KeyType* keys, size_t n, const KeyType& key, const WeakCmp& les) {
+            return std::lower_bound(keys, keys+n, key, les)-keys;
+        }
+
+        static size_t upper(const KeyType* keys, size_t n, const KeyType& key, const WeakCmp& les) {
+            return std::upper_bound(keys, keys+n, key, les)-keys;
+        }
+    };
+
+    template<typename KeyType, typename WeakCmp>
+    struct KeySearch<KeyType, WeakCmp, true> {
+        // keys scanned linearly once the bisection is down to this many
+        static const size_t WINDOW = 256/sizeof(KeyType);
+
+        static size_t lower(const KeyType* keys, size_t n, const KeyType& key, const WeakCmp&) {
+            // keys in front of base are < key
+            const KeyType* base = keys;
+            while (n > WINDOW) {
+                size_t half = n/2;
+                base = base[half] < key ? base+half : base;
+                n -= half;
+            }
+            return base-keys+count_keys<false>(base, n, key);
+        }
+
+        static size_t upper(const KeyType* keys, size_t n, const KeyType& key, const WeakCmp&) {
+            // keys in front of base are <= key
+            const KeyType* base = keys;
+            while (n > WINDOW) {
+                size_t half = n/2;
+                base = key < base[half] ? base : base+half;
+                n -= half;
+            }
+            return base-keys+n-count_keys<true>(base, n, key);
+        }
+    };
+
+    /*
+     * Eytzinger: a sorted array stored in the breadth-first order of its implicit binary search tree,
+     * so the first steps of every search share a few cache lines. lower/upper return sorted positions like KeySearch.
+     */
+    template<typename KeyType, typename WeakCmp>
+    class Eytzinger {
+        std::vector<KeyType> keys;      // keys[1, n], keys[0] unused
+        std::vector<uint32_t> rank;     // sorted position of keys[k]
+
+        size_t fill(const KeyType* sorted, size_t i, size_t k) {
+            if (k < keys.size()) {
+                i = fill(sorted, i, 2*k);
+                keys[k] = sorted[i];
+                rank[k] = (uint32_t) i++;
+                i = fill(sorted, i, 2*k+1);
+            }
+            return i;
+        }
+
+        // k ends past a leaf of the implicit tree, drop the right turns taken since the last left one
+        size_t position(size_t k) const {
+            k >>= __builtin_ffsll(~k);
+            return k ? rank[k] : keys.size()-1;
+        }
+
+    public:
+        Eytzinger(const KeyType* sorted, size_t n) : keys(n+1), rank(n+1) { fill(sorted, 0, 1); }
+
+        size_t size() const { return keys.size()-1; }
+
+        size_t lower(const KeyType& key, const WeakCmp& les) const {
+            size_t k = 1;
+            while (k < keys.size())k = 2*k+les(keys[k], key);
+            return position(k);
+        }
+
+        size_t upper(const KeyType& key, const WeakCmp& les) const {
+            size_t k = 1;
+            while (k < keys.size())k = 2*k+!les(key, keys[k]);
+            return position(k);
+        }
+    };
+}
+#endif //BPTREE_SEARCH_H
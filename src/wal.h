@@ -0,0 +1,286 @@
+#ifndef BPTREE_WAL_H
+#define BPTREE_WAL_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace wal {
+    /*
+     * SYNC_ALWAYS: every commit is durable once settle() returns
+     * SYNC_GROUP: commits are synced together every group_ops commits, and no later than group_micros
+     * microseconds after the oldest unsynced one, by a timer thread when no commit comes along
+     * SYNC_NONE: the log is only synced before a dirty page reaches the data file and at checkpoints
+     */
+    typedef enum {
+        SYNC_ALWAYS, SYNC_GROUP, SYNC_NONE
+    } sync_t;
+
+    /*
+     * Redo log of page after-images. A record holds every page one operation dirtied plus the file header,
+     * so replaying the committed records over the last checkpoint restores a consistent file.
+     *
+     * record: length(8) checksum(8) | lsn(8) page_count(4) header_len(4) header (offset(8) page)*
+     *
+     * One thread at a time writes the pending records and syncs them, outside the lock, so commits go on
+     * meanwhile. Threads that need a sync while one runs wait for it and sync the rest together afterwards.
+     */
+    class WriteAheadLog {
+    private:
+        // unsynced commits kept in memory before they are written anyway
+        const static size_t BUFFER_LIMIT = 1 << 20;
+        const static size_t RECORD_HEAD = 2*sizeof(uint64_t);
+
+        int fd;
+        size_t block_size;
+        sync_t policy;
+        size_t group_ops;
+        std::chrono::microseconds group_interval;
+
+        std::vector<char> record;   // operation being logged
+        uint32_t record_pages;
+        std::vector<char> pending;  // committed but not written yet
+        size_t unsynced_ops;
+        std::chrono::steady_clock::time_point unsynced_since;
+        uint64_t lsn;
+        uint64_t synced_lsn;        // records up to it are durable
+        bool syncing, failed, stopping;
+        size_t log_size;
+        std::mutex lock;
+        std::condition_variable synced;
+        std::condition_variable timer_wake;
+        std::thread timer;
+
+        static uint64_t checksum(const char* buf, size_t len) {
+            // FNV-1a
+            uint64_t h = 0xcbf29ce484222325ull;
+            for (size_t i = 0; i < len; ++i) {
+                h ^= (unsigned char) buf[i];
+                h *= 0x100000001b3ull;
+            }
+            return h;
+        }
+
+        template<typename T>
+        static void append(std::vector<char>& buf, const T& value) {
+            buf.insert(buf.end(), (const char*) &value, (const char*) &value+sizeof(T));
+        }
+
+        void write_all(const std::vector<char>& buf) {
+            size_t done = 0;
+            while (done < buf.size()) {
+                ssize_t n = ::write(fd, buf.data()+done, buf.size()-done);
+                if (n < 0)throw std::runtime_error("WAL: write failure");
+                done += n;
+            }
+        }
+
+        // records reach the file in lsn order, so nothing is written while a sync has records in hand
+        void write_pending() {
+            write_all(pending);
+            pending.clear();
+        }
+
+        // guard holds lock, and is released while writing and syncing
+        void sync_to(std::unique_lock<std::mutex>& guard, uint64_t target) {
+            while (synced_lsn < target) {
+                if (failed)throw std::runtime_error("WAL: sync failure");
+                if (syncing) {
+                    synced.wait(guard);
+                    continue;
+                }
+                if (!unsynced_ops && pending.empty()) {
+                    synced_lsn = lsn;
+                    return;
+                }
+                syncing = true;
+                std::vector<char> batch;
+                batch.swap(pending);
+                uint64_t upto = lsn;
+                unsynced_ops = 0;
+                guard.unlock();
+                bool ok = true;
+                try {
+                    write_all(batch);
+                    ok = !::fdatasync(fd);
+                } catch (...) { ok = false; }
+                guard.lock();
+                syncing = false;
+                if (ok)synced_lsn = upto;
+                else failed = true;
+                synced.notify_all();
+            }
+        }
+
+        // SYNC_GROUP: sync what has waited group_interval when no commit does it first
+        void run_timer() {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!stopping) {
+                if (!unsynced_ops) {
+                    timer_wake.wait(guard);
+                    continue;
+                }
+                auto due = unsynced_since+group_interval;
+                if (std::chrono::steady_clock::now() < due) {
+                    timer_wake.wait_until(guard, due);
+                    continue;
+                }
+                try {
+                    sync_to(guard, lsn);
+                } catch (...) {
+                    // the next commit that syncs reports it
+                    return;
+                }
+            }
+        }
+
+    public:
+        WriteAheadLog(const std::string& path, size_t block_size, sync_t policy = SYNC_GROUP,
+                      size_t group_ops = 64, size_t group_micros = 2000)
+                : block_size(block_size), policy(policy), group_ops(group_ops), group_interval(group_micros),
+                  record_pages(0), unsynced_ops(0), lsn(0), synced_lsn(0), syncing(false), failed(false), stopping(false) {
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+            if (fd < 0)throw std::runtime_error("WAL: can't open "+path);
+            log_size = ::lseek(fd, 0, SEEK_END);
+            if (policy == SYNC_GROUP)timer = std::thread(&WriteAheadLog::run_timer, this);
+        }
+
+        WriteAheadLog(const WriteAheadLog&) = delete;
+
+        WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+        ~WriteAheadLog() {
+            if (timer.joinable()) {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    stopping = true;
+                }
+                timer_wake.notify_one();
+                timer.join();
+            }
+            try { sync(); } catch (...) {}
+            ::close(fd);
+        }
+
+        void add_page(uint64_t offset, const char* image) {
+            if (record.empty())record.resize(RECORD_HEAD+sizeof(uint64_t)+2*sizeof(uint32_t));
+            append(record, offset);
+            record.insert(record.end(), image, image+block_size);
+            ++record_pages;
+        }
+
+        /*
+         * commit: close the record of the current operation with the file header. It is only queued,
+         * settle() makes it durable as the policy says, once the caller no longer holds up other committers.
+         */
+        void commit(const char* header, uint32_t header_len) {
+            if (record.empty())record.resize(RECORD_HEAD+sizeof(uint64_t)+2*sizeof(uint32_t));
+            // the header goes in front of the pages
+            record.insert(record.begin()+RECORD_HEAD+sizeof(uint64_t)+2*sizeof(uint32_t), header, header+header_len);
+            // the timer thread reads lsn
+            std::lock_guard<std::mutex> guard(lock);
+            uint64_t body_len = record.size()-RECORD_HEAD, seq = lsn+1;
+            char* body = record.data()+RECORD_HEAD;
+            memcpy(body, &seq, sizeof(seq));
+            memcpy(body+sizeof(seq), &record_pages, sizeof(record_pages));
+            memcpy(body+sizeof(seq)+sizeof(record_pages), &header_len, sizeof(header_len));
+            uint64_t sum = checksum(body, body_len);
+            memcpy(record.data(), &body_len, sizeof(body_len));
+            memcpy(record.data()+sizeof(body_len), &sum, sizeof(sum));
+
+            pending.insert(pending.end(), record.begin(), record.end());
+            log_size += record.size();
+            lsn = seq;
+            record.clear();
+            record_pages = 0;
+            if (!unsynced_ops++) {
+                unsynced_since = std::chrono::steady_clock::now();
+                if (policy == SYNC_GROUP)timer_wake.notify_one();
+            }
+            if (policy == SYNC_NONE && !syncing && pending.size() >= BUFFER_LIMIT)write_pending();
+        }
+
+        /*
+         * settle: sync the commits so far if the policy asks for it now, SYNC_ALWAYS always and
+         * SYNC_GROUP once group_ops commits are waiting. Commits of other threads ride along.
+         */
+        void settle() {
+            if (policy == SYNC_NONE)return;
+            std::unique_lock<std::mutex> guard(lock);
+            if (policy == SYNC_ALWAYS || unsynced_ops >= group_ops)sync_to(guard, lsn);
+        }
+
+        /*
+         * sync: make every committed record durable, must happen before a page it covers reaches the data file
+         */
+        void sync() {
+            std::unique_lock<std::mutex> guard(lock);
+            sync_to(guard, lsn);
+        }
+
+        size_t size() {
+            std::lock_guard<std::mutex> guard(lock);
+            return log_size;
+        }
+
+        /*
+         * truncate: drop the log once a checkpoint made the data file consistent by itself
+         */
+        void truncate() {
+            std::unique_lock<std::mutex> guard(lock);
+            synced.wait(guard, [this] { return !syncing; });
+            pending.clear();
+            unsynced_ops = 0;
+            if (::ftruncate(fd, 0) || ::fdatasync(fd))throw std::runtime_error("WAL: truncate failure");
+            log_size = 0;
+            synced_lsn = lsn;
+        }
+
+        /*
+         * replay: feed every complete record to apply_page(offset, image) and apply_header(header, len),
+         * stops at the first torn or corrupted record. Truncate the log afterwards, new records
+         * would land behind whatever stopped it. @return number of records replayed
+         */
+        template<typename PageFunc, typename HeaderFunc>
+        size_t replay(PageFunc apply_page, HeaderFunc apply_header) {
+            std::lock_guard<std::mutex> guard(lock);
+            std::vector<char> body;
+            size_t count = 0;
+            off_t pos = 0;
+            for (;;) {
+                uint64_t head[2];
+                if (::pread(fd, head, sizeof(head), pos) != sizeof(head))break;
+                if (!head[0] || head[0] > log_size)break;
+                body.resize(head[0]);
+                if (::pread(fd, body.data(), body.size(), pos+sizeof(head)) != (ssize_t) body.size())break;
+                if (checksum(body.data(), body.size()) != head[1])break;
+                uint32_t pages, header_len;
+                const char* ptr = body.data()+sizeof(uint64_t);
+                memcpy(&lsn, body.data(), sizeof(lsn));
+                memcpy(&pages, ptr, sizeof(pages));
+                memcpy(&header_len, ptr+sizeof(pages), sizeof(header_len));
+                ptr += sizeof(pages)+sizeof(header_len);
+                const char* header = ptr;
+                ptr += header_len;
+                for (uint32_t i = 0; i < pages; ++i, ptr += sizeof(uint64_t)+block_size) {
+                    uint64_t offset;
+                    memcpy(&offset, ptr, sizeof(offset));
+                    apply_page(offset, ptr+sizeof(uint64_t));
+                }
+                apply_header(header, header_len);
+                pos += sizeof(head)+body.size();
+                ++count;
+            }
+            return count;
+        }
+    };
+}
+#endif //BPTREE_WAL_H
@@ -0,0 +1,210 @@
+/*
+ * Every backend against a std::map: random inserts and removes, batches, bulk_load,
+ * reopening the file and compaction, checked through search, multi_search, range and both cursors.
+ * Built once as is and once with BPTREE_ORDER_STATS, which also checks rank, count and select.
+ */
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "LRUBPtree.h"
+#include "MMapBPtree.h"
+#include "MemBPtree.h"
+#include "check.h"
+
+using namespace bptree;
+
+typedef std::map<long, long> Model;
+
+static const long KEYS = 20000;
+
+// the model keeps longs, VarKey trees store them zero padded so that they sort the same
+template<typename K>
+struct keys {
+    static K of(long k) { return k; }
+    static long back(const K& k) { return k; }
+};
+
+template<size_t N>
+struct keys<VarKey<N>> {
+    static VarKey<N> of(long k) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%08ld", k);
+        return VarKey<N>(buf);
+    }
+    static long back(const VarKey<N>& k) { return std::stol(k.str()); }
+};
+
+template<typename T, typename K>
+void same(T& t, const Model& model, std::mt19937& rng) {
+    typedef keys<K> Keys;
+    auto all = t.range(Keys::of(0), Keys::of(KEYS));
+    CHECK(all.size() == model.size());
+    size_t i = 0;
+    for (auto& p : model) {
+        CHECK(Keys::back(all[i].first) == p.first && all[i].second == p.second);
+        ++i;
+    }
+    {
+        auto c = t.cursor(Keys::of(0));
+        for (auto& p : model) {
+            CHECK(c.valid() && Keys::back(c.key()) == p.first && c.value() == p.second);
+            c.next();
+        }
+        CHECK(!c.valid());
+    }
+    {
+        auto c = t.reverse_cursor(Keys::of(KEYS));
+        for (auto p = model.rbegin(); p != model.rend(); ++p) {
+            CHECK(c.valid() && Keys::back(c.key()) == p->first && c.value() == p->second);
+            c.prev();
+        }
+        CHECK(!c.valid());
+    }
+    std::vector<K> probe;
+    for (int q = 0; q < 500; ++q)probe.push_back(Keys::of(rng()%KEYS));
+    auto found = t.multi_search(probe);
+    for (size_t q = 0; q < probe.size(); ++q) {
+        auto m = model.find(Keys::back(probe[q]));
+        auto r = t.search(probe[q]);
+        CHECK(r.second == (m != model.end()) && found[q].second == r.second);
+        if (r.second)CHECK(r.first == m->second && found[q].first == m->second);
+    }
+#ifdef BPTREE_ORDER_STATS
+    for (int q = 0; q < 200; ++q) {
+        long low = rng()%KEYS, high = rng()%KEYS;
+        auto below = (uint64_t) std::distance(model.begin(), model.lower_bound(low));
+        CHECK(t.rank(Keys::of(low)) == below);
+        uint64_t expect = low > high ? 0 : std::distance(model.lower_bound(low), model.upper_bound(high));
+        CHECK(t.count(Keys::of(low), Keys::of(high)) == expect);
+        auto c = t.select(below);
+        if (below == model.size())CHECK(!c.valid());
+        else CHECK(c.valid() && Keys::back(c.key()) == model.lower_bound(low)->first);
+    }
+#endif
+}
+
+template<typename T, typename K>
+void modify(T& t, Model& model, std::mt19937& rng, int rounds) {
+    typedef keys<K> Keys;
+    for (int round = 0; round < rounds; ++round) {
+        int op = rng()%8;
+        if (op < 3) {
+            long k = rng()%KEYS;
+            if (model.count(k))continue;
+            t.insert(Keys::of(k), k*3);
+            model[k] = k*3;
+        } else if (op < 6) {
+            long k = rng()%KEYS;
+            CHECK(t.remove(Keys::of(k)) == (model.erase(k) == 1));
+        } else if (op == 6) {
+            std::vector<std::pair<K, long>> batch;
+            for (int i = 0; i < 50; ++i) {
+                long k = rng()%KEYS;
+                if (model.count(k))continue;
+                batch.emplace_back(Keys::of(k), k*3);
+                model[k] = k*3;
+            }
+            t.insert_batch(batch.begin(), batch.end());
+        } else {
+            std::vector<K> batch;
+            std::map<long, bool> seen;
+            size_t removed = 0;
+            for (int i = 0; i < 50; ++i) {
+                long k = rng()%KEYS;
+                if (seen[k])continue;
+                seen[k] = true;
+                batch.push_back(Keys::of(k));
+                removed += model.erase(k);
+            }
+            CHECK(t.remove_batch(batch.begin(), batch.end()) == removed);
+        }
+    }
+}
+
+// open(create) returns a fresh tree with create set, the same file reopened otherwise, nullptr if it can't be reopened
+template<typename T, typename K, typename Open>
+void run(const char* name, Open open) {
+    typedef keys<K> Keys;
+    std::mt19937 rng(7);
+    Model model;
+    {
+        std::unique_ptr<T> t = open(true);
+        modify<T, K>(*t, model, rng, 30000);
+        same<T, K>(*t, model, rng);
+        t->compact();
+        same<T, K>(*t, model, rng);
+    }
+    if (std::unique_ptr<T> t = open(false)) {
+        same<T, K>(*t, model, rng);
+        modify<T, K>(*t, model, rng, 10000);
+        t->compact([](size_t placed, size_t) { return placed < 40; }, 16);
+        same<T, K>(*t, model, rng);
+        modify<T, K>(*t, model, rng, 5000);
+        same<T, K>(*t, model, rng);
+    }
+    if (std::unique_ptr<T> t = open(false))
+        same<T, K>(*t, model, rng);
+
+    // bulk_load takes sorted input only and leaves the tree empty otherwise
+    model.clear();
+    for (long k = 0; k < KEYS; k += 3)model[k] = k*3;
+    std::vector<std::pair<K, long>> sorted;
+    for (auto& p : model)sorted.emplace_back(Keys::of(p.first), p.second);
+    std::unique_ptr<T> t = open(true);
+    auto unsorted = sorted;
+    std::swap(unsorted[unsorted.size()/2], unsorted[unsorted.size()/2+1]);
+    bool thrown = false;
+    try {
+        t->bulk_load(unsorted.begin(), unsorted.end());
+    } catch (std::logic_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    CHECK(t->range(Keys::of(0), Keys::of(KEYS)).empty());
+    t->bulk_load(sorted.begin(), sorted.end(), 0.7);
+    same<T, K>(*t, model, rng);
+    modify<T, K>(*t, model, rng, 10000);
+    same<T, K>(*t, model, rng);
+    printf("%s ok\n", name);
+}
+
+template<typename T>
+std::unique_ptr<T> open_lru(const std::string& path, bool create, const LRUBPTreeOptions& options) {
+    if (create) {
+        std::remove(path.c_str());
+        std::remove((path+".wal").c_str());
+    }
+    return std::unique_ptr<T>(new T(path, 64, create, options));
+}
+
+int main() {
+    typedef LRUBPTree<long, long, std::less<long>, 8> LRU;
+    run<LRU, long>("lru", [](bool create) { return open_lru<LRU>("test_lru.db", create, LRUBPTreeOptions()); });
+
+    LRUBPTreeOptions options;
+    options.shards = 1;
+    options.policy = cache::TWO_Q;
+    options.codec = CODEC_DELTA;
+    options.swizzle = false;
+    options.top_index_nodes = 16;
+    options.wal = true;
+    // durability is up to the wal test, this one only runs the logging path
+    options.wal_sync = wal::SYNC_NONE;
+    run<LRU, long>("lru delta 2q wal", [&](bool create) { return open_lru<LRU>("test_lru_delta.db", create, options); });
+
+    typedef LRUBPTree<VarKey<16>, long> Var;
+    run<Var, VarKey<16>>("lru varkey", [](bool create) { return open_lru<Var>("test_lru_var.db", create, LRUBPTreeOptions()); });
+
+    typedef MMapBPTree<long, long, std::less<long>, 8> MMap;
+    run<MMap, long>("mmap", [](bool create) {
+        if (create)std::remove("test_mmap.db");
+        return std::unique_ptr<MMap>(new MMap("test_mmap.db", create));
+    });
+
+    typedef MemBPTree<long, long, std::less<long>, 8> Mem;
+    run<Mem, long>("mem", [](bool create) { return create ? std::unique_ptr<Mem>(new Mem()) : nullptr; });
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef BPTREE_TESTS_CHECK_H
+#define BPTREE_TESTS_CHECK_H
+
+#include <cstdio>
+#include <cstdlib>
+
+// the tests are plain executables run by ctest, a failed check ends the run with its location
+#define CHECK(...) do { \
+        if (!(__VA_ARGS__)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #__VA_ARGS__); \
+            exit(1); \
+        } \
+    } while (0)
+
+#endif //BPTREE_TESTS_CHECK_H
@@ -0,0 +1,153 @@
+/*
+ * Snapshots under concurrent writers: writer threads insert and remove odd keys next to a bulk loaded set
+ * of even ones and log every operation. Readers take a snapshot together with the length of the log,
+ * then scan it, search it and run parallel_range on it while the writers go on, and compare with the log replayed
+ * up to that length. Run against every backend. A snapshot that needs more node copies than the version
+ * limit expires.
+ */
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include "LRUBPtree.h"
+#include "MMapBPtree.h"
+#include "MemBPtree.h"
+#include "check.h"
+
+using namespace bptree;
+
+typedef std::map<long, long> Model;
+
+static const long EVEN = 20000;
+
+template<typename T>
+void run(const char* name, T& t) {
+    std::vector<std::pair<long, long>> even;
+    for (long k = 0; k < EVEN; ++k)even.emplace_back(k*2, k);
+    t.bulk_load(even.begin(), even.end());
+
+    // (key, value) of every write in the order the tree took them, value -1 for a remove
+    std::mutex log_lock;
+    std::vector<std::pair<long, long>> log;
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> writers;
+    for (int w = 0; w < 2; ++w) {
+        writers.emplace_back([&, w] {
+            std::mt19937 rng(w);
+            for (long i = 0; !stop; ++i) {
+                long k = (long) (rng()%EVEN)*2+1;
+                std::lock_guard<std::mutex> guard(log_lock);
+                if (t.remove(k))log.emplace_back(k, -1);
+                else {
+                    t.insert(k, i);
+                    log.emplace_back(k, i);
+                }
+            }
+        });
+    }
+
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 2; ++r) {
+        readers.emplace_back([&, r] {
+            std::mt19937 rng(100+r);
+            for (int n = 0; n < 8; ++n) {
+                std::unique_ptr<typename T::Snapshot> s;
+                Model model;
+                {
+                    std::lock_guard<std::mutex> guard(log_lock);
+                    s.reset(new typename T::Snapshot(t.snapshot()));
+                    for (auto& op : log) {
+                        if (op.second < 0)model.erase(op.first);
+                        else model[op.first] = op.second;
+                    }
+                }
+                for (long k = 0; k < EVEN; ++k)model[k*2] = k;
+                std::this_thread::yield();
+
+                auto all = s->range(0, EVEN*2);
+                CHECK(all.size() == model.size());
+                auto c = s->cursor(0);
+                size_t i = 0;
+                for (auto& p : model) {
+                    CHECK(all[i].first == p.first && all[i].second == p.second);
+                    CHECK(c.valid() && c.key() == p.first && c.value() == p.second);
+                    c.next();
+                    ++i;
+                }
+                CHECK(!c.valid());
+                for (int q = 0; q < 1000; ++q) {
+                    long k = rng()%(EVEN*2);
+                    auto found = s->search(k);
+                    auto m = model.find(k);
+                    CHECK(found.second == (m != model.end()));
+                    if (found.second)CHECK(found.first == m->second);
+                }
+                CHECK(s->parallel_range(100, EVEN*2-100, 4) == s->range(100, EVEN*2-100));
+            }
+        });
+    }
+    for (auto& r : readers)r.join();
+    stop = true;
+    for (auto& w : writers)w.join();
+
+    // the live tree saw every write
+    Model model;
+    for (long k = 0; k < EVEN; ++k)model[k*2] = k;
+    for (auto& op : log) {
+        if (op.second < 0)model.erase(op.first);
+        else model[op.first] = op.second;
+    }
+    auto all = t.parallel_range(0, EVEN*2, 3);
+    CHECK(all == std::vector<std::pair<long, long>>(model.begin(), model.end()));
+    printf("%s ok, %zu writes\n", name, log.size());
+}
+
+// past the version limit the oldest snapshot expires and throws, newer ones still read the tree as they saw it
+static void limit() {
+    MemBPTree<long, long, std::less<long>, 16> t;
+    t.set_version_limit(64);
+    for (long k = 0; k < 4000; ++k)t.insert(k, k);
+    auto old = t.snapshot();
+    CHECK(old.search(10).second);
+    // spread over many leaves, so that far more than 64 nodes change
+    for (long k = 0; k < 4000; k += 7)t.remove(k);
+    bool thrown = false;
+    try {
+        old.search(10);
+    } catch (std::runtime_error&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    auto recent = t.snapshot();
+    Model model;
+    for (auto& p : t.range(0, 4000))model.insert(p);
+    for (long k = 1; k < 400; k += 7)t.remove(k);
+    auto all = recent.range(0, 4000);
+    CHECK(all == std::vector<std::pair<long, long>>(model.begin(), model.end()));
+    printf("version limit ok\n");
+}
+
+int main() {
+    limit();
+    {
+        std::remove("test_snapshot.db");
+        LRUBPTreeOptions options;
+        options.top_index_nodes = 8;
+        LRUBPTree<long, long, std::less<long>, 16> t("test_snapshot.db", 256, true, options);
+        run("lru", t);
+    }
+    {
+        std::remove("test_snapshot_mmap.db");
+        MMapBPTree<long, long, std::less<long>, 16> t("test_snapshot_mmap.db", true);
+        run("mmap", t);
+    }
+    {
+        MemBPTree<long, long, std::less<long>, 16> t;
+        run("mem", t);
+    }
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Crash recovery through the write-ahead log: a child process runs a sequence of inserts and removes
+ * and ends with _exit, skipping the destructors and the final checkpoint, then the tree is reopened.
+ * With SYNC_ALWAYS every operation that returned survives, with SYNC_GROUP and SYNC_NONE the tree
+ * comes back as of some prefix of the operations that covers every sync() the child made.
+ * A torn record found in the log on open must not hide the records written after it.
+ */
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "LRUBPtree.h"
+#include "check.h"
+
+using namespace bptree;
+
+typedef LRUBPTree<long, long, std::less<long>, 8> Tree;
+typedef std::map<long, long> Model;
+
+static const char* PATH = "test_wal.db";
+
+// operation i removes its key if present, and inserts it with value i otherwise
+static std::vector<long> operations(size_t n) {
+    std::mt19937 rng(11);
+    std::vector<long> ops;
+    for (size_t i = 0; i < n; ++i)ops.push_back(rng()%4000);
+    return ops;
+}
+
+static void apply(Model& model, long key, long i) {
+    if (!model.erase(key))model[key] = i;
+}
+
+static Model contents(Tree& t) {
+    Model m;
+    for (auto& p : t.range(0, 4000))m.insert(p);
+    return m;
+}
+
+static LRUBPTreeOptions options(wal::sync_t sync) {
+    LRUBPTreeOptions o;
+    o.wal = true;
+    o.wal_sync = sync;
+    o.shards = 1;
+    // checkpoints and evictions of dirty nodes happen during the run
+    o.checkpoint_bytes = 256 << 10;
+    return o;
+}
+
+// run ops[0, n) in a child that syncs after synced of them and dies without closing the tree
+static void crash(const std::vector<long>& ops, size_t n, size_t synced, wal::sync_t sync) {
+    std::remove(PATH);
+    std::remove((std::string(PATH)+".wal").c_str());
+    pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (!pid) {
+        Tree t(PATH, 64, true, options(sync));
+        for (size_t i = 0; i < n; ++i) {
+            if (!t.remove(ops[i]))t.insert(ops[i], (long) i);
+            if (i+1 == synced)t.sync();
+        }
+        _exit(0);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main() {
+    const size_t N = 6000;
+    std::vector<long> ops = operations(N);
+
+    crash(ops, N, 0, wal::SYNC_ALWAYS);
+    {
+        Model model;
+        for (size_t i = 0; i < N; ++i)apply(model, ops[i], (long) i);
+        Tree t(PATH, 64, false, options(wal::SYNC_ALWAYS));
+        CHECK(contents(t) == model);
+    }
+    printf("always ok\n");
+
+    for (wal::sync_t sync : {wal::SYNC_GROUP, wal::SYNC_NONE}) {
+        crash(ops, N, N/2, sync);
+        Tree t(PATH, 64, false, options(sync));
+        Model found = contents(t), model;
+        size_t i = 0;
+        for (; i < N/2; ++i)apply(model, ops[i], (long) i);
+        for (; model != found && i < N; ++i)apply(model, ops[i], (long) i);
+        CHECK(model == found);
+        // the recovered tree takes writes and survives a clean close
+        for (size_t j = 0; j < 500; ++j, ++i) {
+            if (!t.remove(ops[j]))t.insert(ops[j], (long) i);
+            apply(model, ops[j], (long) i);
+        }
+        CHECK(contents(t) == model);
+        printf("%s ok\n", sync == wal::SYNC_GROUP ? "group" : "none");
+    }
+
+    // a torn record left in the log is cut on open, so that the records written after it are replayed
+    {
+        std::remove(PATH);
+        std::remove((std::string(PATH)+".wal").c_str());
+        // neither a checkpoint nor an eviction may save the inserts, only the log
+        LRUBPTreeOptions o = options(wal::SYNC_ALWAYS);
+        o.checkpoint_bytes = 64 << 20;
+        { Tree t(PATH, 4096, true, o); }
+        FILE* f = fopen((std::string(PATH)+".wal").c_str(), "ab");
+        CHECK(f);
+        // the length of a record that fits, then a checksum that doesn't match
+        uint64_t torn[3] = {8, 12345, 0};
+        CHECK(fwrite(torn, sizeof(torn), 1, f) == 1);
+        fclose(f);
+        pid_t pid = fork();
+        CHECK(pid >= 0);
+        if (!pid) {
+            Tree t(PATH, 4096, false, o);
+            for (long k = 0; k < 1000; ++k)t.insert(k, k);
+            _exit(0);
+        }
+        int status;
+        CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        Tree t(PATH, 4096, false, o);
+        Model model;
+        for (long k = 0; k < 1000; ++k)model[k] = k;
+        CHECK(contents(t) == model);
+    }
+    printf("torn tail ok\n");
+    return 0;
+}